@@ -24,10 +24,12 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -37,7 +39,9 @@
 #include "rkflashtool.h"
 #include "version.h"
 
-#ifndef _WIN32
+#ifdef _WIN32
+#include <windows.h>
+#else
 #define O_BINARY 0
 #endif
 
@@ -57,58 +61,177 @@ static void info_and_fatal(const int s, char *f, ...) {
 #define info(...)   info_and_fatal(0, __VA_ARGS__)
 #define fatal(...)  info_and_fatal(1, __VA_ARGS__)
 
+/*
+ * The input is mapped and split in up to MAX_THREADS parts of at least
+ * MIN_PART bytes, whose CRCs are computed in parallel and then combined.
+ * The output is written from the mapping while they run.
+ */
+#define MAX_THREADS 16
+#define MIN_PART    (4 << 20)
+
+struct part {
+    pthread_t thread;
+    uint8_t *data;
+    uint64_t size;
+    uint32_t crc;
+};
+
+static struct part parts[MAX_THREADS];
+static int nparts;
+
+static void *crc_thread(void *arg) {
+    struct part *p = arg;
+
+    p->crc = rkcrc32(0, p->data, p->size);
+    return NULL;
+}
+
+static void crc_start(uint8_t *data, uint64_t size) {
+    uint64_t n = 1, step;
+    int i;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (n > MAX_THREADS) n = MAX_THREADS;
+    if (n > size / MIN_PART) n = size / MIN_PART;
+    if (n < 1) n = 1;
+
+    nparts = n;
+    step = size / n;
+    for (i = 0; i < nparts; i++) {
+        parts[i].data = data + i * step;
+        parts[i].size = i == nparts - 1 ? size - i * step : step;
+        if (nparts == 1)
+            crc_thread(&parts[i]);
+        else if (pthread_create(&parts[i].thread, NULL, crc_thread, &parts[i]))
+            fatal("cannot create thread\n");
+    }
+}
+
+static uint32_t crc_finish(void) {
+    uint32_t crc = 0;
+    int i;
+
+    for (i = 0; i < nparts; i++) {
+        if (nparts > 1)
+            pthread_join(parts[i].thread, NULL);
+        crc = rkcrc32_combine(crc, parts[i].crc, parts[i].size);
+    }
+    return crc;
+}
+
+static void write_all(int fd, const uint8_t *p, uint64_t n, const char *name) {
+    ssize_t nw;
+
+    for (; n > 0; p += nw, n -= nw)
+        if ((nw = write(fd, p, n < 0x40000000 ? n : 0x40000000)) <= 0)
+            fatal("%s: write error\n", name);
+}
+
 int main(int argc, char *argv[]) {
     struct stat st;
-    ssize_t nr;
-    uint32_t crc = 0;
-    uint8_t buf[512];
+    uint32_t crc;
+    uint64_t size, off = 0;
+    uint8_t *map = NULL, hdr[8];
     char *progname = argv[0];
-    int ch, which = -1, in, out;
+    int ch, which = -1, check = 0, inplace = 0, in, out;
+#ifdef _WIN32
+    HANDLE fm = NULL;
+#endif
 
-    while ((ch = getopt(argc, argv, "kp")) != -1) {
+    while ((ch = getopt(argc, argv, "kpci")) != -1) {
         switch (ch) {
         case 'k': which = 0; break;
         case 'p': which = 1; break;
+        case 'c': check = 1; break;
+        case 'i': inplace = 1; break;
         default: break;
         }
     }
     argc -= optind;
     argv += optind;
 
-    if (argc != 2)
-        fatal("rkcrc v%d.%d\nusage: %s [-k|-p] infile outfile\n",
+    if (argc != (check || inplace ? 1 : 2) || (check && inplace) ||
+                                             (inplace && which >= 0))
+        fatal("rkcrc v%d.%d\nusage: %s [-k|-p] infile outfile\n"
+              "       %s -i file\n"
+              "       %s -c [-k|-p] file\n",
                     RKFLASHTOOL_VERSION_MAJOR,
-                    RKFLASHTOOL_VERSION_MINOR, progname);
+                    RKFLASHTOOL_VERSION_MINOR, progname, progname, progname);
 
-
-    if ((in = open(argv[0], O_BINARY | O_RDONLY)) == -1)
+    if ((in = open(argv[0], O_BINARY | (inplace ? O_RDWR : O_RDONLY))) == -1)
         fatal("%s: %s\n", argv[0], strerror(errno));
 
     if (fstat(in, &st) != 0)
         fatal("%s: %s\n", argv[0], strerror(errno));
 
-    if ((out = open(argv[1], O_BINARY | O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
-        fatal("%s: %s\n", argv[1], strerror(errno));
+    size = st.st_size;
+    if (size > 0) {
+#ifdef _WIN32
+        fm  = CreateFileMapping((HANDLE)_get_osfhandle(in), NULL, PAGE_READONLY, 0, 0, NULL);
+        map = MapViewOfFile(fm, FILE_MAP_READ, 0, 0, 0);
+        if (!map) fatal("%s: cannot create MapView of File\n", argv[0]);
+#else
+        if ((map = mmap(NULL, size, PROT_READ, MAP_SHARED, in, 0)) == MAP_FAILED)
+            fatal("%s: %s\n", argv[0], strerror(errno));
+#endif
+    }
 
-    if (which >= 0) {
-        memcpy(buf, headers[which], 4);
-        PUT32LE(buf+4, st.st_size);
-        if(write(out, buf, 8) != 8)
-          fatal("%s: write error\n", argv[1]);
+    if (check) {
+        /* a KRNL/PARM header is recognized by itself, -k/-p insist on it */
+        if (size >= 12 && (uint32_t)GET32LE(map+4) == size - 12 &&
+            (which >= 0 ? !memcmp(map, headers[which], 4) :
+                          !memcmp(map, headers[0], 4) || !memcmp(map, headers[1], 4)))
+            off = 8;
+        else if (which >= 0)
+            fatal("%s: no %.4s header\n", argv[0], headers[which]);
+        if (size < off + 4)
+            fatal("%s: too short\n", argv[0]);
+
+        crc_start(map + off, size - off - 4);
+        crc = crc_finish();
+        if (crc != (uint32_t)GET32LE(map + size - 4))
+            fatal("%s: bad checksum (%08x, should be %08x)\n",
+                  argv[0], GET32LE(map + size - 4), crc);
+        info("%s: checksum matches (%08x)\n", argv[0], crc);
+        return 0;
     }
 
-    while ((nr = read(in, buf, sizeof(buf))) > 0) {
-        crc = rkcrc32(crc, buf, nr);
-        if(write(out, buf, nr) != nr)
-          fatal("%s: write error\n", argv[1]);
+    crc_start(map, size);
+
+    if (inplace) {
+        out = in;
+    } else {
+        if ((out = open(argv[1], O_BINARY | O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+            fatal("%s: %s\n", argv[1], strerror(errno));
+
+        if (which >= 0) {
+            memcpy(hdr, headers[which], 4);
+            PUT32LE(hdr+4, size);
+            write_all(out, hdr, 8, argv[1]);
+        }
+        write_all(out, map, size, argv[1]);
     }
 
-    PUT32LE(buf, crc);
-    if(write(out, buf, 4) != 4)
-      fatal("%s: write error\n", argv[1]);
+    crc = crc_finish();
+    PUT32LE(hdr, crc);
+    if (inplace && lseek(out, size, SEEK_SET) == -1)
+        fatal("%s: %s\n", argv[0], strerror(errno));
+    write_all(out, hdr, 4, argv[inplace ? 0 : 1]);
 
     close(out);
-    close(in);
+#ifdef _WIN32
+    if (map) {
+        UnmapViewOfFile(map);
+        CloseHandle(fm);
+    }
+#else
+    if (map)
+        munmap(map, size);
+#endif
+    if (!inplace)
+        close(in);
 
     return 0;
 }
@@ -199,8 +199,12 @@ static uint32_t crc32table[] = {
 	0xbcbb966d, 0xb87a9bda, 0xb5398d03, 0xb1f880b4,
 };
 
+/*
+ * Reference implementations, one byte per step.  Every other variant
+ * below must give bit-identical results to these.
+ */
 static inline uint16_t
-rkcrc16(uint16_t crc, uint8_t *buf, uint64_t size)
+rkcrc16_table(uint16_t crc, uint8_t *buf, uint64_t size)
 {
 
 	while (size-- > 0)
@@ -210,7 +214,7 @@ rkcrc16(uint16_t crc, uint8_t *buf, uint64_t size)
 }
 
 static inline uint32_t
-rkcrc32(uint32_t crc, uint8_t *buf, uint64_t size)
+rkcrc32_table(uint32_t crc, uint8_t *buf, uint64_t size)
 {
 
 	while (size-- > 0)
@@ -218,6 +222,346 @@ rkcrc32(uint32_t crc, uint8_t *buf, uint64_t size)
 
 	return crc;
 }
+
+/*
+ * Slicing-by-8/16: crcNNslice[k][i] is the CRC of byte i followed by k
+ * zero bytes, so n bytes can be looked up independently and combined.
+ * Rockchip's CRCs are not reflected, so the crc register lines up with
+ * the first bytes of each group in big-endian order.
+ */
+static uint16_t crc16slice[16][256];
+static uint32_t crc32slice[16][256];
+
+static inline uint16_t
+rkcrc16_slice(uint16_t crc, uint8_t *buf, uint64_t size, const int n)
+{
+	int i;
+
+	while (size >= (uint64_t)n) {
+		crc ^= buf[0] << 8 | buf[1];
+		crc = crc16slice[n - 1][crc >> 8] ^ crc16slice[n - 2][crc & 0xff];
+		for (i = 2; i < n; i++)
+			crc ^= crc16slice[n - 1 - i][buf[i]];
+		buf += n;
+		size -= n;
+	}
+
+	return rkcrc16_table(crc, buf, size);
+}
+
+static inline uint32_t
+rkcrc32_slice(uint32_t crc, uint8_t *buf, uint64_t size, const int n)
+{
+	int i;
+
+	while (size >= (uint64_t)n) {
+		crc ^= (uint32_t)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+		crc = crc32slice[n - 1][crc >> 24] ^
+		      crc32slice[n - 2][(crc >> 16) & 0xff] ^
+		      crc32slice[n - 3][(crc >> 8) & 0xff] ^
+		      crc32slice[n - 4][crc & 0xff];
+		for (i = 4; i < n; i++)
+			crc ^= crc32slice[n - 1 - i][buf[i]];
+		buf += n;
+		size -= n;
+	}
+
+	return rkcrc32_table(crc, buf, size);
+}
+
+static inline uint16_t
+rkcrc16_slice8(uint16_t crc, uint8_t *buf, uint64_t size)
+{
+	return rkcrc16_slice(crc, buf, size, 8);
+}
+
+static inline uint16_t
+rkcrc16_slice16(uint16_t crc, uint8_t *buf, uint64_t size)
+{
+	return rkcrc16_slice(crc, buf, size, 16);
+}
+
+static inline uint32_t
+rkcrc32_slice8(uint32_t crc, uint8_t *buf, uint64_t size)
+{
+	return rkcrc32_slice(crc, buf, size, 8);
+}
+
+static inline uint32_t
+rkcrc32_slice16(uint32_t crc, uint8_t *buf, uint64_t size)
+{
+	return rkcrc32_slice(crc, buf, size, 16);
+}
+
+/* x^n mod P for the CRC32 polynomial */
+static inline uint32_t
+rkcrc32_xpow(int n)
+{
+	uint32_t r = 1;
+
+	while (n-- > 0)
+		r = r & 0x80000000 ? (r << 1) ^ 0x04c10db7 : r << 1;
+
+	return r;
+}
+
+/*
+ * Carry-less multiply folding (PCLMULQDQ on x86, PMULL on ARMv8).
+ *
+ * 16 byte blocks are loaded byte-swapped, so that bit 127 of a register
+ * is the first bit of the block.  A register X that is followed by d more
+ * bits of the message contributes X * x^d, and with X = H * x^64 + L that
+ * is congruent to H * (x^(d+64) mod P) + L * (x^d mod P), which fits in
+ * 96 bits again.  Four registers are folded 512 bits ahead in parallel,
+ * then combined.  The last register is reduced with the reference table,
+ * since its CRC is simply that of its 16 bytes with an initial crc of 0.
+ */
+static uint32_t rkcrc32_k512[2], rkcrc32_k128[2];	/* { x^d, x^(d+64) } */
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define RKCRC_CLMUL
+#include <cpuid.h>
+#include <immintrin.h>
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i
+rkcrc32_fold(__m128i x, __m128i k, __m128i data)
+{
+	return _mm_xor_si128(data, _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11),
+	                                         _mm_clmulepi64_si128(x, k, 0x00)));
+}
+
+__attribute__((target("pclmul,ssse3")))
+static uint32_t
+rkcrc32_clmul(uint32_t crc, uint8_t *buf, uint64_t size)
+{
+	const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+	                                  8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i k, x0, x1, x2, x3;
+	uint8_t tmp[16];
+
+	if (size < 64)
+		return rkcrc32_slice16(crc, buf, size);
+
+#define LOAD(p)	_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p)), swap)
+	x0 = _mm_xor_si128(LOAD(buf), _mm_set_epi32(crc, 0, 0, 0));
+	x1 = LOAD(buf + 16);
+	x2 = LOAD(buf + 32);
+	x3 = LOAD(buf + 48);
+	buf += 64;
+	size -= 64;
+
+	k = _mm_set_epi64x(rkcrc32_k512[1], rkcrc32_k512[0]);
+	while (size >= 64) {
+		x0 = rkcrc32_fold(x0, k, LOAD(buf));
+		x1 = rkcrc32_fold(x1, k, LOAD(buf + 16));
+		x2 = rkcrc32_fold(x2, k, LOAD(buf + 32));
+		x3 = rkcrc32_fold(x3, k, LOAD(buf + 48));
+		buf += 64;
+		size -= 64;
+	}
+
+	k = _mm_set_epi64x(rkcrc32_k128[1], rkcrc32_k128[0]);
+	x1 = rkcrc32_fold(x0, k, x1);
+	x2 = rkcrc32_fold(x1, k, x2);
+	x0 = rkcrc32_fold(x2, k, x3);
+	while (size >= 16) {
+		x0 = rkcrc32_fold(x0, k, LOAD(buf));
+		buf += 16;
+		size -= 16;
+	}
+#undef LOAD
+
+	_mm_storeu_si128((__m128i *)tmp, _mm_shuffle_epi8(x0, swap));
+	crc = rkcrc32_table(0, tmp, 16);
+
+	return rkcrc32_slice16(crc, buf, size);
+}
+
+static inline int
+rkcrc_have_clmul(void)
+{
+	unsigned int a, b, c, d;
+
+	/* PCLMULQDQ and SSSE3 (for the byte swap) */
+	return __get_cpuid(1, &a, &b, &c, &d) && (c & bit_PCLMUL) && (c & bit_SSSE3);
+}
+
+#elif defined(__aarch64__) && defined(__linux__) && defined(__GNUC__)
+#define RKCRC_CLMUL
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_PMULL
+#define HWCAP_PMULL	(1 << 4)
+#endif
+#ifdef __clang__
+#define RKCRC_TARGET	__attribute__((target("aes")))
+#else
+#define RKCRC_TARGET	__attribute__((target("+crypto")))
 #endif
 
+RKCRC_TARGET
+static inline uint64x2_t
+rkcrc32_fold(uint64x2_t x, uint64x2_t k, uint64x2_t data)
+{
+	poly128_t h = vmull_high_p64(vreinterpretq_p64_u64(x),
+	                             vreinterpretq_p64_u64(k));
+	poly128_t l = vmull_p64((poly64_t)vgetq_lane_u64(x, 0),
+	                        (poly64_t)vgetq_lane_u64(k, 0));
+
+	return veorq_u64(data, veorq_u64(vreinterpretq_u64_p128(h),
+	                                 vreinterpretq_u64_p128(l)));
+}
+
+/* Byte-swap all 16 bytes, to and from the big-endian register layout */
+RKCRC_TARGET
+static inline uint64x2_t
+rkcrc32_swap(uint8x16_t v)
+{
+	v = vrev64q_u8(v);
+	return vreinterpretq_u64_u8(vextq_u8(v, v, 8));
+}
+
+RKCRC_TARGET
+static uint32_t
+rkcrc32_clmul(uint32_t crc, uint8_t *buf, uint64_t size)
+{
+	uint64x2_t k, x0, x1, x2, x3;
+	uint8_t tmp[16];
+
+	if (size < 64)
+		return rkcrc32_slice16(crc, buf, size);
+
+#define LOAD(p)	rkcrc32_swap(vld1q_u8(p))
+	x0 = veorq_u64(LOAD(buf), vcombine_u64(vcreate_u64(0),
+	                                       vcreate_u64((uint64_t)crc << 32)));
+	x1 = LOAD(buf + 16);
+	x2 = LOAD(buf + 32);
+	x3 = LOAD(buf + 48);
+	buf += 64;
+	size -= 64;
+
+	k = vcombine_u64(vcreate_u64(rkcrc32_k512[0]), vcreate_u64(rkcrc32_k512[1]));
+	while (size >= 64) {
+		x0 = rkcrc32_fold(x0, k, LOAD(buf));
+		x1 = rkcrc32_fold(x1, k, LOAD(buf + 16));
+		x2 = rkcrc32_fold(x2, k, LOAD(buf + 32));
+		x3 = rkcrc32_fold(x3, k, LOAD(buf + 48));
+		buf += 64;
+		size -= 64;
+	}
+
+	k = vcombine_u64(vcreate_u64(rkcrc32_k128[0]), vcreate_u64(rkcrc32_k128[1]));
+	x1 = rkcrc32_fold(x0, k, x1);
+	x2 = rkcrc32_fold(x1, k, x2);
+	x0 = rkcrc32_fold(x2, k, x3);
+	while (size >= 16) {
+		x0 = rkcrc32_fold(x0, k, LOAD(buf));
+		buf += 16;
+		size -= 16;
+	}
+#undef LOAD
+
+	vst1q_u8(tmp, vreinterpretq_u8_u64(rkcrc32_swap(vreinterpretq_u8_u64(x0))));
+	crc = rkcrc32_table(0, tmp, 16);
+
+	return rkcrc32_slice16(crc, buf, size);
+}
+
+static inline int
+rkcrc_have_clmul(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+}
+#endif
+
+/*
+ * Runtime dispatch.  The tables and the choice of kernel are set up
+ * before main(), so the CRC functions can be used from any thread.
+ */
+static uint16_t (*rkcrc16_impl)(uint16_t, uint8_t *, uint64_t) = rkcrc16_table;
+static uint32_t (*rkcrc32_impl)(uint32_t, uint8_t *, uint64_t) = rkcrc32_table;
+
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+static void
+rkcrc_init(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc16slice[0][i] = crc16table[i];
+		crc32slice[0][i] = crc32table[i];
+	}
+	for (k = 1; k < 16; k++)
+		for (i = 0; i < 256; i++) {
+			uint16_t c16 = crc16slice[k - 1][i];
+			uint32_t c32 = crc32slice[k - 1][i];
+
+			crc16slice[k][i] = (c16 << 8) ^ crc16table[c16 >> 8];
+			crc32slice[k][i] = (c32 << 8) ^ crc32table[c32 >> 24];
+		}
+
+	rkcrc32_k512[0] = rkcrc32_xpow(512);
+	rkcrc32_k512[1] = rkcrc32_xpow(512 + 64);
+	rkcrc32_k128[0] = rkcrc32_xpow(128);
+	rkcrc32_k128[1] = rkcrc32_xpow(128 + 64);
+
+	rkcrc16_impl = rkcrc16_slice8;
+	rkcrc32_impl = rkcrc32_slice16;
+#ifdef RKCRC_CLMUL
+	if (rkcrc_have_clmul())
+		rkcrc32_impl = rkcrc32_clmul;
+#endif
+}
+
+static inline uint16_t
+rkcrc16(uint16_t crc, uint8_t *buf, uint64_t size)
+{
+	return rkcrc16_impl(crc, buf, size);
+}
+
+static inline uint32_t
+rkcrc32(uint32_t crc, uint8_t *buf, uint64_t size)
+{
+	return rkcrc32_impl(crc, buf, size);
+}
+#endif
+
+/* a * b mod P */
+static inline uint32_t
+rkcrc32_mulmod(uint32_t a, uint32_t b)
+{
+	uint32_t r = 0;
+	int i;
+
+	for (i = 31; i >= 0; i--) {
+		r = r & 0x80000000 ? (r << 1) ^ 0x04c10db7 : r << 1;
+		if (b >> i & 1)
+			r ^= a;
+	}
+
+	return r;
+}
+
+/*
+ * CRC combination: the crc of A followed by B is that of A, advanced over
+ * len(B) zero bytes (times x^(8 * len(B)) mod P), plus that of B alone.
+ * So the parts of a buffer can be done in parallel, each from crc 0.
+ */
+static inline uint32_t
+rkcrc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	uint32_t x = 1, p = 0x100;	/* x^8 */
+
+	for (; len2 > 0; len2 >>= 1) {
+		if (len2 & 1)
+			x = rkcrc32_mulmod(x, p);
+		p = rkcrc32_mulmod(p, p);
+	}
+
+	return rkcrc32_mulmod(crc1, x) ^ crc2;
+}
+
 #endif /* !_RKCRC_H_ */
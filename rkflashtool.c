@@ -32,27 +32,46 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#else
+#include <time.h>
+#endif
 #include <libusb.h>
 
 /* hack to set binary mode for stdin / stdout on Windows */
 #ifdef _WIN32
-#include <fcntl.h>
 int _CRT_fmode = _O_BINARY;
+#else
+#define O_BINARY 0
 #endif
 
 #include "version.h"
 #include "rkcrc.h"
 #include "rkflashtool.h"
+#include "sha256.h"
 
 #define EP1_READ 0x81
 #define EP1_WRITE 0x1
 
 #define RKFT_BLOCKSIZE      0x4000      /* must be multiple of 512 */
+#define RKFT_MAX_BLOCKSIZE  0x100000    /* largest --blocksize */
 #define RKFT_IDB_DATASIZE   0x200
 #define RKFT_IDB_BLOCKSIZE  0x210
 #define RKFT_IDB_INCR       0x20
 #define RKFT_MEM_INCR       0x80
 #define RKFT_OFF_INCR       (RKFT_BLOCKSIZE>>9)
+#define RKFT_MAX_QUEUE      64          /* max. commands in flight */
 #define MAX_PARAM_LENGTH    (128*512-12) /* cf. MAX_LOADER_PARAM in rkloader */
 #define SDRAM_BASE_ADDRESS  0x60000000
 
@@ -177,18 +196,45 @@ struct bulk_cs_wrap {
 #define USB_BULK_CB_WRAP_LEN	31
 #define USB_BULK_CS_WRAP_LEN	13
 
-static uint8_t cbw[USB_BULK_CB_WRAP_LEN], csw[USB_BULK_CS_WRAP_LEN], buf[RKFT_BLOCKSIZE];
-static uint8_t ibuf[RKFT_IDB_BLOCKSIZE];
+static uint8_t cbw[USB_BULK_CB_WRAP_LEN], csw[USB_BULK_CS_WRAP_LEN], buf[RKFT_MAX_BLOCKSIZE];
 static libusb_context *c;
 static libusb_device_handle *h = NULL;
-static int tmp;
+static int tmp, queue_depth = 1, blocksize = RKFT_BLOCKSIZE;
+
+/* Per device state in flash-farm mode, shared between the workers */
+struct farm_slot {
+    char path[32];              /* bus-port.port... */
+    char line[128];             /* last message of the worker */
+    double start, end;
+    int pid, done, status;
+};
+
+static struct farm_slot *farm;
+static int farm_mode, farm_count, farm_index = -1;
+
+/* Daemon mode: the connection of the request being served */
+static int daemon_client = -1;
+static char **daemon_argv;
+static void daemon_restart(int status);
+
 static const char *const strings[2] = { "info", "fatal" };
 static void info_and_fatal(const int s, const int cr, char *f, ...) {
     va_list ap;
     va_start(ap,f);
-    fprintf(stderr, "%srkflashtool: %s: ", cr ? "\r" : "", strings[s]);
-    vfprintf(stderr, f, ap);
+    if (farm_index >= 0) {
+        /* Farm workers report through their slot, one line each */
+        char *p, *line = farm[farm_index].line;
+        vsnprintf(line, sizeof(farm->line), f, ap);
+        for (p = line; *p; p++)
+            if (*p == '\n' || *p == '\t' || *p == '\r')
+                *p = ' ';
+    } else {
+        fprintf(stderr, "%srkflashtool: %s: ", cr ? "\r" : "", strings[s]);
+        vfprintf(stderr, f, ap);
+    }
     va_end(ap);
+    if (s && daemon_client >= 0)
+        daemon_restart(s);
     if (s) exit(s);
 }
 
@@ -213,12 +259,648 @@ static void usage(void) {
           "\trkflashtool r offset nsectors >outfile \tread flash\n"
           "\trkflashtool w offset nsectors <infile  \twrite flash\n"
           "\trkflashtool p >file             \tfetch parameters\n"
+          "\trkflashtool list                \tlist partitions (offset size name)\n"
           "\trkflashtool P <file             \twrite parameters\n"
+          "\trkflashtool U <update.img       \tflash every partition of an update.img\n"
           "\trkflashtool e partname          \terase flash (fill with 0xff)\n"
           "\trkflashtool e offset nsectors   \terase flash (fill with 0xff)\n"
+          "\trkflashtool bench offset nsectors >json\tbenchmark on a scratch range\n"
+          "\trkflashtool daemon socket           \tkeep the device open, serve --socket\n"
+          "options (before the action):\n"
+          "\t--queue depth                   \tkeep up to depth commands in flight\n"
+          "\t--blocksize bytes|auto          \ttransfer size for r, w and e\n"
+          "\t--manifest file                 \tw: skip blocks unchanged since last write\n"
+          "\t--readback                      \tw: hash the device if there is no manifest\n"
+          "\t--sparse                        \tr: write an Android sparse image\n"
+          "\t--verify                        \tw, P: read back and compare what was written\n"
+          "\t--input file                    \tread from file instead of stdin\n"
+          "\t--output file                   \twrite to file instead of stdout\n"
+          "\t--journal file                  \tr, w: record progress for --resume\n"
+          "\t--resume                        \tr, w: continue where the journal stopped\n"
+          "\t--all                           \trun on every attached device at once\n"
+          "\t--emulate image[,opt=val...]    \tuse a loader emulated on an image file\n"
+          "\t--trace file|fd                 \twrite a JSON line per command\n"
+          "\t--stats                         \tprint per command latency statistics\n"
+          "\t--socket path                   \trun the command on a daemon\n"
+          "\t--wait seconds                  \twait for a device to appear\n"
+          "\t--idb-copies n                  \tj: write n copies, a NAND block apart\n"
+          "\t--loader file                   \tin MASK ROM mode, boot this loader first\n"
          );
 }
 
+/*
+ * Transports
+ *
+ * Everything that goes to the device passes through a transport: either
+ * the USB device via libusb, or a loader emulated in this process on top
+ * of a flash image file.  Only the libusb transport can run the
+ * asynchronous engine, other transports execute its slots synchronously.
+ */
+struct transport {
+    int (*bulk)(uint8_t ep, uint8_t *data, int length, int *transferred,
+                unsigned int timeout);
+    int (*control)(uint8_t request_type, uint8_t request, uint16_t value,
+                   uint16_t index, uint8_t *data, uint16_t length);
+    void (*clear_halt)(uint8_t ep);
+    void (*close)(void);
+    int async;
+};
+
+static int usb_bulk(uint8_t ep, uint8_t *data, int length, int *transferred,
+                    unsigned int timeout)
+{
+    return libusb_bulk_transfer(h, ep, data, length, transferred, timeout);
+}
+
+static int usb_control(uint8_t request_type, uint8_t request, uint16_t value,
+                       uint16_t index, uint8_t *data, uint16_t length)
+{
+    return libusb_control_transfer(h, request_type, request, value, index,
+                                   data, length, 0);
+}
+
+static void usb_clear_halt(uint8_t ep)
+{
+    libusb_clear_halt(h, ep);
+}
+
+static void usb_close(void)
+{
+    libusb_release_interface(h, 0);
+    libusb_close(h);
+    libusb_exit(c);
+}
+
+static const struct transport usb_transport = {
+    usb_bulk, usb_control, usb_clear_halt, usb_close, 1
+};
+
+/*
+ * Loader emulator
+ *
+ * Implements the CBW/CSW protocol of doc/protocol.txt against a flash
+ * image file (LBA space), an IDB sidecar file (528 byte sectors), an
+ * SDRAM buffer and optionally a parameter file that is written to the
+ * parameter block on startup.  latency and bandwidth model a real board:
+ *
+ *   --emulate image[,size=sectors][,latency=us][,bandwidth=MB/s]
+ *                  [,sdram=MB][,param=file]
+ */
+#define EMU_SDRAM_SIZE      64          /* MB */
+#define EMU_ERASE_BLOCK     0x200       /* sectors */
+
+static struct {
+    int fd, idb;
+    uint32_t sectors, sdram_size;
+    uint8_t *sdram;
+    uint8_t cbw[USB_BULK_CB_WRAP_LEN];
+    uint8_t *data;              /* pending data stage */
+    int data_len, data_pos, data_out;
+    int csw_pending, status;
+    unsigned int latency;       /* us per command */
+    double bandwidth;           /* bytes/s, 0 is unlimited */
+} emu;
+
+static void emu_delay(int bytes)
+{
+    double us = 0;
+
+    if (emu.bandwidth > 0)
+        us = bytes / emu.bandwidth * 1e6;
+    if (us >= 1)
+        usleep(us);
+}
+
+static int emu_io(int out, int fd, uint32_t sector, int sectorsize, int count)
+{
+    off_t pos = (off_t)sector * sectorsize;
+    int length = count * sectorsize;
+
+    if (lseek(fd, pos, SEEK_SET) == -1)
+        return -1;
+    if (out)
+        return write(fd, emu.data, length) == length ? 0 : -1;
+    memset(emu.data, 0, length);        /* unwritten areas read as zeroes */
+    return read(fd, emu.data, length) < 0 ? -1 : 0;
+}
+
+/* Data stage of a write command has been received */
+static void emu_write_done(void)
+{
+    uint32_t offset;
+    int n;
+
+    offset = emu.cbw[17] << 24 | emu.cbw[18] << 16 | emu.cbw[19] << 8 | emu.cbw[20];
+    n = emu.cbw[22] << 8 | emu.cbw[23];
+
+    switch (emu.cbw[15]) {
+    case RKFT_CMD_WRITELBA & 0xff:
+        emu.status = emu_io(1, emu.fd, offset, 512, n);
+        break;
+    case RKFT_CMD_WRITESECTOR & 0xff:
+        emu.status = emu_io(1, emu.idb, offset, RKFT_IDB_BLOCKSIZE, n);
+        break;
+    case RKFT_CMD_WRITESDRAM & 0xff:
+        memcpy(emu.sdram + offset, emu.data, n);
+        break;
+    }
+    emu.data_len = 0;
+    emu.csw_pending = 1;
+}
+
+static void emu_command(void)
+{
+    nand_info *nand;
+    uint32_t offset;
+    int n, length = 0, out = 0;
+
+    offset = emu.cbw[17] << 24 | emu.cbw[18] << 16 | emu.cbw[19] << 8 | emu.cbw[20];
+    n = emu.cbw[22] << 8 | emu.cbw[23];
+    emu.status = 0;
+    if (emu.latency)
+        usleep(emu.latency);
+
+    switch (emu.cbw[12] << 24 | emu.cbw[14] << 8 | emu.cbw[15]) {
+    case RKFT_CMD_TESTUNITREADY:
+    case RKFT_CMD_RESETDEVICE:
+    case RKFT_CMD_SETRESETFLASG:
+    case RKFT_CMD_SETDEVICEINFO:
+    case RKFT_CMD_EXECUTESDRAM:
+    case RKFT_CMD_ERASESYSTEMDISK:
+    case RKFT_CMD_LOWERFORMAT:
+        break;
+    case RKFT_CMD_READFLASHID:
+        length = 5;
+        memcpy(emu.data, "EMU\x01\x00", length);
+        break;
+    case RKFT_CMD_READFLASHINFO:
+        length = 512;
+        memset(emu.data, 0, length);
+        nand = (nand_info *) emu.data;
+        nand->flash_size = emu.sectors;
+        nand->block_size = EMU_ERASE_BLOCK;
+        nand->page_size = 8;
+        nand->ecc_bits = 40;
+        nand->access_time = 32;
+        nand->manufacturer_id = 7;
+        nand->chip_select = 1;
+        break;
+    case RKFT_CMD_READCHIPINFO:
+        length = 16;
+        memcpy(emu.data, "LUME0000000000000", length);
+        break;
+    case RKFT_CMD_READEFUSE:
+        length = 8;
+        memset(emu.data, 0, length);
+        break;
+    case RKFT_CMD_READLBA:
+        if (offset + n > emu.sectors || emu_io(0, emu.fd, offset, 512, n))
+            emu.status = 1;
+        else
+            length = n << 9;
+        break;
+    case RKFT_CMD_WRITELBA:
+        if (offset + n > emu.sectors)
+            emu.status = 1;
+        else
+            length = n << 9, out = 1;
+        break;
+    case RKFT_CMD_ERASESECTORS:
+        if (offset + n > emu.sectors)
+            emu.status = 1;
+        else {
+            memset(emu.data, 0xff, n << 9);
+            emu.status = emu_io(1, emu.fd, offset, 512, n);
+        }
+        break;
+    case RKFT_CMD_READSECTOR:
+        if (emu_io(0, emu.idb, offset, RKFT_IDB_BLOCKSIZE, n))
+            emu.status = 1;
+        else
+            length = n * RKFT_IDB_BLOCKSIZE;
+        break;
+    case RKFT_CMD_WRITESECTOR:
+        length = n * RKFT_IDB_BLOCKSIZE, out = 1;
+        break;
+    case RKFT_CMD_READSDRAM:
+        if (offset + n > emu.sdram_size)
+            emu.status = 1;
+        else {
+            length = n;
+            memcpy(emu.data, emu.sdram + offset, n);
+        }
+        break;
+    case RKFT_CMD_WRITESDRAM:
+        if (offset + n > emu.sdram_size)
+            emu.status = 1;
+        else
+            length = n, out = 1;
+        break;
+    default:
+        emu.status = 1;
+    }
+
+    emu.data_len = length;
+    emu.data_pos = 0;
+    emu.data_out = out;
+    emu.csw_pending = !out || !length;
+    if (out && !length)
+        emu_write_done();
+}
+
+static int emu_bulk(uint8_t ep, uint8_t *data, int length, int *transferred,
+                    unsigned int timeout)
+{
+    int n;
+
+    (void)timeout;
+    *transferred = 0;
+    emu_delay(length);
+
+    if (ep == EP1_WRITE) {
+        if (emu.data_len && emu.data_out) {
+            n = emu.data_len - emu.data_pos < length ? emu.data_len - emu.data_pos : length;
+            memcpy(emu.data + emu.data_pos, data, n);
+            if ((emu.data_pos += n) == emu.data_len)
+                emu_write_done();
+        } else if (length == USB_BULK_CB_WRAP_LEN && !memcmp(data, "USBC", 4)) {
+            memcpy(emu.cbw, data, USB_BULK_CB_WRAP_LEN);
+            emu_command();
+        } else
+            return LIBUSB_ERROR_PIPE;
+        *transferred = length;
+        return 0;
+    }
+
+    if (emu.data_len && !emu.data_out) {
+        n = emu.data_len - emu.data_pos < length ? emu.data_len - emu.data_pos : length;
+        memcpy(data, emu.data + emu.data_pos, n);
+        if ((emu.data_pos += n) == emu.data_len) {
+            emu.data_len = 0;
+            emu.csw_pending = 1;
+        }
+        *transferred = n;
+        return 0;
+    }
+    if (emu.csw_pending) {
+        n = length < USB_BULK_CS_WRAP_LEN ? length : USB_BULK_CS_WRAP_LEN;
+        memset(data, 0, n);
+        memcpy(data, "USBS", n < 4 ? n : 4);
+        if (n >= 8)
+            memcpy(data + 4, emu.cbw + 4, 4);
+        if (n > 12)
+            data[12] = emu.status;
+        emu.csw_pending = 0;
+        *transferred = n;
+        return 0;
+    }
+    return LIBUSB_ERROR_TIMEOUT;
+}
+
+static int emu_control(uint8_t request_type, uint8_t request, uint16_t value,
+                       uint16_t index, uint8_t *data, uint16_t length)
+{
+    (void)request_type; (void)request; (void)value; (void)index; (void)data;
+    if (emu.latency)
+        usleep(emu.latency);
+    emu_delay(length);
+    return length;
+}
+
+static void emu_clear_halt(uint8_t ep)
+{
+    (void)ep;
+    emu.data_len = emu.csw_pending = 0;
+}
+
+static void emu_close(void)
+{
+    close(emu.fd);
+    close(emu.idb);
+    free(emu.sdram);
+    free(emu.data);
+}
+
+static const struct transport emu_transport = {
+    emu_bulk, emu_control, emu_clear_halt, emu_close, 0
+};
+
+static void emu_param(const char *path)
+{
+    uint8_t *p = emu.data;
+    uint32_t crc;
+    int fd, n, offset;
+
+    if ((fd = open(path, O_RDONLY | O_BINARY)) == -1)
+        fatal("%s: %s\n", path, strerror(errno));
+    memset(p, 0, RKFT_BLOCKSIZE);
+    memcpy(p, "PARM", 4);
+    if ((n = read(fd, p + 8, RKFT_BLOCKSIZE - 12)) < 0)
+        fatal("%s: %s\n", path, strerror(errno));
+    close(fd);
+    PUT32LE(p + 4, n);
+    crc = rkcrc32(0, p + 8, n);
+    PUT32LE(p + 8 + n, crc);
+    for (offset = 0; offset < 0x2000; offset += 0x400)
+        if (emu_io(1, emu.fd, offset, 512, RKFT_OFF_INCR))
+            fatal("%s: cannot write parameters\n", path);
+}
+
+static void emu_open(char *spec)
+{
+    char *image = strtok(spec, ","), *opt, *param = NULL, idbpath[PATH_MAX];
+    uint32_t size = 0;
+    struct stat st;
+
+    emu.sdram_size = EMU_SDRAM_SIZE << 20;
+    while ((opt = strtok(NULL, ","))) {
+        if (!strncmp(opt, "size=", 5))
+            size = strtoul(opt + 5, NULL, 0);
+        else if (!strncmp(opt, "latency=", 8))
+            emu.latency = strtoul(opt + 8, NULL, 0);
+        else if (!strncmp(opt, "bandwidth=", 10))
+            emu.bandwidth = strtod(opt + 10, NULL) * 1e6;
+        else if (!strncmp(opt, "sdram=", 6))
+            emu.sdram_size = strtoul(opt + 6, NULL, 0) << 20;
+        else if (!strncmp(opt, "param=", 6))
+            param = opt + 6;
+        else
+            fatal("unknown emulator option %s\n", opt);
+    }
+    if (!image)
+        fatal("--emulate needs an image file\n");
+
+    if ((emu.fd = open(image, O_RDWR | O_CREAT | O_BINARY, 0644)) == -1 ||
+        fstat(emu.fd, &st))
+        fatal("%s: %s\n", image, strerror(errno));
+    if (size && ftruncate(emu.fd, (off_t)size << 9))
+        fatal("%s: %s\n", image, strerror(errno));
+    emu.sectors = size ? size : st.st_size >> 9;
+    if (!emu.sectors)
+        fatal("%s: empty image, give its size with size=sectors\n", image);
+
+    snprintf(idbpath, sizeof(idbpath), "%s.idb", image);
+    if ((emu.idb = open(idbpath, O_RDWR | O_CREAT | O_BINARY, 0644)) == -1)
+        fatal("%s: %s\n", idbpath, strerror(errno));
+
+    if (!(emu.sdram = calloc(1, emu.sdram_size)) ||
+        !(emu.data = malloc(0x10000 * RKFT_IDB_BLOCKSIZE)))
+        fatal("out of memory\n");
+    if (param)
+        emu_param(param);
+
+    info("emulating loader on %s (%u sectors)\n", image, emu.sectors);
+}
+
+static const struct transport *tp = &usb_transport;
+static char device_location[128] = "unknown";   /* USB bus-port path */
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Command tracing and statistics
+ *
+ * --trace writes one JSON line per command (CBW to CSW) and --stats
+ * prints counts, bytes and a latency histogram per opcode at the end.
+ * Either one puts a tracing transport on top of the real one, which
+ * follows the CBW, data and CSW stages of the synchronous path.  The
+ * asynchronous engine reports its slots as they retire.  Without these
+ * options nothing is installed and the only cost is one branch per slot.
+ */
+#define TRACE_BUCKETS       24          /* log2 microseconds */
+#define TRACE_MAX_OPCODES   32
+
+static const struct {
+    uint32_t command;
+    const char *name;
+} cmdnames[] = {
+    { RKFT_CMD_TESTUNITREADY,   "TESTUNITREADY" },
+    { RKFT_CMD_READFLASHID,     "READFLASHID" },
+    { RKFT_CMD_READFLASHINFO,   "READFLASHINFO" },
+    { RKFT_CMD_READCHIPINFO,    "READCHIPINFO" },
+    { RKFT_CMD_READEFUSE,       "READEFUSE" },
+    { RKFT_CMD_SETDEVICEINFO,   "SETDEVICEINFO" },
+    { RKFT_CMD_ERASESYSTEMDISK, "ERASESYSTEMDISK" },
+    { RKFT_CMD_SETRESETFLASG,   "SETRESETFLAG" },
+    { RKFT_CMD_RESETDEVICE,     "RESETDEVICE" },
+    { RKFT_CMD_TESTBADBLOCK,    "TESTBADBLOCK" },
+    { RKFT_CMD_READSECTOR,      "READSECTOR" },
+    { RKFT_CMD_READLBA,         "READLBA" },
+    { RKFT_CMD_READSDRAM,       "READSDRAM" },
+    { RKFT_CMD_WRITESECTOR,     "WRITESECTOR" },
+    { RKFT_CMD_ERASESECTORS,    "ERASESECTORS" },
+    { RKFT_CMD_WRITELBA,        "WRITELBA" },
+    { RKFT_CMD_WRITESDRAM,      "WRITESDRAM" },
+    { RKFT_CMD_EXECUTESDRAM,    "EXECUTESDRAM" },
+    { RKFT_CMD_WRITEEFUSE,      "WRITEEFUSE" },
+    { RKFT_CMD_WRITESPARE,      "WRITESPARE" },
+    { RKFT_CMD_READSPARE,       "READSPARE" },
+    { RKFT_CMD_LOWERFORMAT,     "LOWERFORMAT" },
+    { RKFT_CMD_WRITENKB,        "WRITENKB" },
+};
+
+static struct opstats {
+    uint32_t command;
+    uint64_t count, bytes, failed;
+    double time, max;
+    uint64_t hist[TRACE_BUCKETS];
+} opstats[TRACE_MAX_OPCODES];
+
+static FILE *trace_file;
+static int tracing, trace_stats, trace_opcodes;
+static double trace_epoch;
+static const struct transport *trace_lower;
+
+/* The synchronous command in progress */
+static struct {
+    uint8_t cbw[USB_BULK_CB_WRAP_LEN];
+    double start;
+    uint64_t bytes;
+    int active;
+} trace_cmd;
+
+static const char *cmdname(uint32_t command)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(cmdnames) / sizeof(cmdnames[0]); i++)
+        if (cmdnames[i].command == command)
+            return cmdnames[i].name;
+    return NULL;
+}
+
+/* One completed command; status is the CSW status, or -1 without a CSW */
+static void trace_command(const uint8_t *cbw, uint64_t bytes, int status,
+                          double start, double end)
+{
+    uint32_t command = cbw[12] << 24 | cbw[13] << 16 | cbw[14] << 8 | cbw[15];
+    uint32_t offset = cbw[17] << 24 | cbw[18] << 16 | cbw[19] << 8 | cbw[20];
+    double us = (end - start) * 1e6;
+    struct opstats *o;
+    int i;
+
+    if (trace_file) {
+        const char *name = cmdname(command);
+
+        fprintf(trace_file, "{\"t\": %.6f, \"cmd\": \"%s\", \"opcode\": \"0x%08x\", "
+                "\"offset\": %u, \"nsectors\": %u, \"bytes\": %llu, "
+                "\"status\": %d, \"us\": %.1f}\n", start - trace_epoch,
+                name ? name : "UNKNOWN", command, offset, cbw[22] << 8 | cbw[23],
+                (unsigned long long)bytes, status, us);
+    }
+
+    if (!trace_stats)
+        return;
+    for (o = opstats; o < opstats + trace_opcodes; o++)
+        if (o->command == command)
+            break;
+    if (o == opstats + trace_opcodes) {
+        if (trace_opcodes == TRACE_MAX_OPCODES)
+            return;
+        trace_opcodes++;
+        o->command = command;
+    }
+    o->count++;
+    o->bytes += bytes;
+    o->failed += status != 0;
+    o->time += us;
+    if (us > o->max)
+        o->max = us;
+    for (i = 0; i < TRACE_BUCKETS - 1 && us >= 1 << (i + 1); i++)
+        ;
+    o->hist[i]++;
+}
+
+static void trace_flush(int status)
+{
+    if (trace_cmd.active)
+        trace_command(trace_cmd.cbw, trace_cmd.bytes, status, trace_cmd.start, now());
+    trace_cmd.active = 0;
+}
+
+static int trace_bulk(uint8_t ep, uint8_t *data, int length, int *transferred,
+                      unsigned int timeout)
+{
+    int r;
+
+    if (ep == EP1_WRITE && length == USB_BULK_CB_WRAP_LEN && !memcmp(data, "USBC", 4)) {
+        trace_flush(-1);
+        memcpy(trace_cmd.cbw, data, USB_BULK_CB_WRAP_LEN);
+        trace_cmd.start = now();
+        trace_cmd.bytes = 0;
+        trace_cmd.active = 1;
+        return trace_lower->bulk(ep, data, length, transferred, timeout);
+    }
+
+    r = trace_lower->bulk(ep, data, length, transferred, timeout);
+    if (ep == EP1_READ && length == USB_BULK_CS_WRAP_LEN && !r &&
+        *transferred == USB_BULK_CS_WRAP_LEN && !memcmp(data, "USBS", 4))
+        trace_flush(data[12]);
+    else if (!r)
+        trace_cmd.bytes += *transferred;
+    return r;
+}
+
+static int trace_control(uint8_t request_type, uint8_t request, uint16_t value,
+                         uint16_t index, uint8_t *data, uint16_t length)
+{
+    return trace_lower->control(request_type, request, value, index, data, length);
+}
+
+static void trace_clear_halt(uint8_t ep)
+{
+    trace_lower->clear_halt(ep);
+}
+
+static void trace_close(void)
+{
+    trace_lower->close();
+}
+
+static struct transport trace_transport = {
+    trace_bulk, trace_control, trace_clear_halt, trace_close, 0
+};
+
+/* Put the tracing transport on top of the current one */
+static void trace_start(const char *path)
+{
+    int fd;
+
+    if (path) {
+        /* A number is a file descriptor that is already open */
+        if (path[strspn(path, "0123456789")] == '\0')
+            fd = atoi(path);
+        else if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+            fatal("%s: %s\n", path, strerror(errno));
+        if (!(trace_file = fdopen(fd, "w")))
+            fatal("trace: %s\n", strerror(errno));
+    }
+    trace_epoch = now();
+    trace_lower = tp;
+    trace_transport.async = tp->async;
+    tp = &trace_transport;
+    tracing = 1;
+}
+
+/* Percentile in microseconds, as the upper bound of its bucket */
+static double trace_percentile(const struct opstats *o, int p)
+{
+    uint64_t n = 0, rank = (o->count * p + 99) / 100;
+    int i;
+
+    for (i = 0; i < TRACE_BUCKETS - 1; i++)
+        if ((n += o->hist[i]) >= rank)
+            break;
+    return i == TRACE_BUCKETS - 1 || o->max < 1 << (i + 1) ? o->max : 1 << (i + 1);
+}
+
+static void trace_stop(void)
+{
+    const struct opstats *o;
+    const char *name;
+    char line[512];
+    int i, n;
+
+    if (!tracing)
+        return;
+    trace_flush(-1);
+    if (trace_file)
+        fclose(trace_file);
+    trace_file = NULL;
+    tracing = 0;
+    tp = trace_lower;
+    if (!trace_stats)
+        goto done;
+
+    info("%-16s %8s %12s %10s %9s %9s %9s %6s\n", "command", "count", "bytes",
+         "avg(us)", "p50(us)", "p99(us)", "max(us)", "failed");
+    for (o = opstats; o < opstats + trace_opcodes; o++) {
+        if (!(name = cmdname(o->command)))
+            snprintf(line, sizeof(line), "0x%08x", o->command), name = line;
+        info("%-16s %8llu %12llu %10.1f %9.0f %9.0f %9.0f %6llu\n", name,
+             (unsigned long long)o->count, (unsigned long long)o->bytes,
+             o->time / o->count, trace_percentile(o, 50), trace_percentile(o, 99),
+             o->max, (unsigned long long)o->failed);
+
+        for (i = n = 0; i < TRACE_BUCKETS; i++)
+            if (o->hist[i] && n < (int)sizeof(line) - 32)
+                n += snprintf(line + n, sizeof(line) - n, " %s%dus:%llu",
+                              i == TRACE_BUCKETS - 1 ? ">=" : "<",
+                              i == TRACE_BUCKETS - 1 ? 1 << i : 1 << (i + 1),
+                              (unsigned long long)o->hist[i]);
+        info("%16s%s\n", "", line);
+    }
+done:
+    memset(opstats, 0, sizeof(opstats));
+    trace_opcodes = 0;
+}
+
 static void send_exec(uint32_t krnl_addr, uint32_t parm_addr) {
     long int r = random();
 
@@ -230,7 +912,7 @@ static void send_exec(uint32_t krnl_addr, uint32_t parm_addr) {
     if (parm_addr)  SETBE32(cbw+22, parm_addr);
                     SETBE32(cbw+12, RKFT_CMD_EXECUTESDRAM);
 
-    libusb_bulk_transfer(h, EP1_WRITE, cbw, sizeof(cbw), &tmp, 0);
+    tp->bulk(EP1_WRITE, cbw, sizeof(cbw), &tmp, 0);
 }
 
 #if 0
@@ -251,12 +933,12 @@ struct fsg_bulk_cb_wrap {
 };
 #endif
 
-/* 发送命令, 对端根据接收到的command, offset, nsectors进行读写操作 */
-static void send_cbw(uint32_t command, uint32_t offset, uint16_t nsectors, uint8_t flag)
+/* 填充cbw, 对端根据接收到的command, offset, nsectors进行读写操作 */
+static void fill_cbw(uint8_t *cbw, uint32_t command, uint32_t offset, uint16_t nsectors, uint8_t flag)
 {
     long int r = random();
 
-	/* 初始化全局cbw变量 <==> Signature */
+	/* 初始化cbw <==> Signature */
     memset(cbw, 0 , 31);
     memcpy(cbw, "USBC", 4);
 
@@ -272,70 +954,2727 @@ static void send_cbw(uint32_t command, uint32_t offset, uint16_t nsectors, uint8
     if (nsectors)
 		SETBE16(cbw+22, nsectors);
 
-	/* command : cbw[12] - cbw[15] <==> Flags, Lun, Length, CDB[0] */
-    if (command)
-		SETBE32(cbw+12, command);
+	/* command : cbw[12] - cbw[15] <==> Flags, Lun, Length, CDB[0] */
+    if (command)
+		SETBE32(cbw+12, command);
+
+	/* set flag for reboot mode */
+	if (flag)
+		cbw[16] = flag;
+}
+
+/* 发送命令 */
+static void send_cbw(uint32_t command, uint32_t offset, uint16_t nsectors, uint8_t flag)
+{
+    fill_cbw(cbw, command, offset, nsectors, flag);
+
+	/* 通过usb传输将cbw发送到对端 */
+    tp->bulk(EP1_WRITE, cbw, sizeof(cbw), &tmp, 0);
+}
+
+static void send_buf(int length)
+{
+    tp->bulk(EP1_WRITE, buf, length, &tmp, 0);
+}
+
+/* 接收USB返回的结果 */
+/* Returns the CSW status, 0 on success */
+static int recv_csw(void)
+{
+    if (tp->bulk(EP1_READ, csw, sizeof(csw), &tmp, 0) ||
+        tmp != sizeof(csw) || memcmp(csw, "USBS", 4))
+        return -1;
+    return csw[12];
+}
+
+static void check_csw(const char *what, uint32_t offset)
+{
+    int status = recv_csw();
+
+    if (status)
+        fatal("%s failed at offset 0x%08x (status %d)\n", what, offset, status);
+}
+
+static void recv_buf(int length)
+{
+    tp->bulk(EP1_READ, buf, length, &tmp, 0);
+}
+
+static void report_rate(const char *what, uint64_t bytes, double start)
+{
+    double secs = now() - start;
+
+    if (secs <= 0)
+        return;
+    info("%s %llu bytes in %.2fs (%.2f MB/s, queue depth %d)\n", what,
+         (unsigned long long)bytes, secs, bytes / secs / 1e6, queue_depth);
+}
+
+/*
+ * Asynchronous transactions
+ *
+ * Every slot carries one complete CBW/data/CSW exchange as three bulk
+ * transfers.  Up to queue_depth slots are submitted ahead so the device
+ * never waits for the host between commands.  Transfers on an endpoint
+ * complete in submission order, so slots are retired oldest first and
+ * their done() callbacks run in command order.
+ */
+struct aio_slot {
+    uint8_t cbw[USB_BULK_CB_WRAP_LEN];
+    uint8_t csw[USB_BULK_CS_WRAP_LEN];
+    uint8_t *buffer;            /* owned by the slot, if allocated */
+    uint8_t *data;              /* data stage, defaults to buffer */
+    int length;
+    int pending;                /* transfers still in flight */
+    int failed;
+    uint32_t offset;
+    struct libusb_transfer *xfer[3];
+    void (*done)(struct aio_slot *);
+    void *user;                 /* for done() */
+    double submitted, completed;
+};
+
+static struct aio_slot aio[RKFT_MAX_QUEUE];
+static int aio_head, aio_used;
+
+static void LIBUSB_CALL aio_callback(struct libusb_transfer *t)
+{
+    struct aio_slot *s = t->user_data;
+
+    if (t->status != LIBUSB_TRANSFER_COMPLETED || t->actual_length != t->length)
+        s->failed = 1;
+    if (t->buffer == s->csw && (memcmp(s->csw, "USBS", 4) || s->csw[12]))
+        s->failed = 1;
+    if (!--s->pending)
+        s->completed = now();
+}
+
+/* Allocate the slots, with a data buffer each unless length is 0 */
+static void aio_init(int length)
+{
+    int i, j;
+
+    for (i = 0; i < queue_depth; i++) {
+        aio[i].buffer = NULL;
+        if (length && !(aio[i].buffer = malloc(length)))
+            fatal("out of memory\n");
+        for (j = 0; j < 3; j++)
+            if (tp->async && !(aio[i].xfer[j] = libusb_alloc_transfer(0)))
+                fatal("cannot allocate transfer\n");
+    }
+    aio_head = aio_used = 0;
+}
+
+static void aio_free(void)
+{
+    int i, j;
+
+    for (i = 0; i < queue_depth; i++) {
+        free(aio[i].buffer);
+        for (j = 0; j < 3 && tp->async; j++)
+            libusb_free_transfer(aio[i].xfer[j]);
+    }
+}
+
+/* Wait for the oldest slot to complete and hand it to its done() */
+static void aio_retire(void)
+{
+    struct aio_slot *s = &aio[aio_head];
+
+    while (s->pending)
+        if (libusb_handle_events(c) < 0)
+            fatal("USB event handling failed\n");
+    if (tracing && s->submitted && tp->async)
+        trace_command(s->cbw, s->length, s->failed ? (s->csw[12] ? s->csw[12] : -1) : 0,
+                      s->submitted, s->completed);
+    if (s->failed)
+        fatal("transfer failed at offset 0x%08x\n", s->offset);
+    if (s->done)
+        s->done(s);
+
+    aio_head = (aio_head + 1) % queue_depth;
+    aio_used--;
+}
+
+/* Get a free slot, retiring the oldest one when the queue is full */
+static struct aio_slot *aio_get(void)
+{
+    struct aio_slot *s;
+
+    if (aio_used == queue_depth)
+        aio_retire();
+    s = &aio[(aio_head + aio_used) % queue_depth];
+    s->data = s->buffer;
+    return s;
+}
+
+static void aio_submit(struct aio_slot *s, uint32_t command, uint32_t offset,
+                       uint16_t nsectors, int length, void (*done)(struct aio_slot *))
+{
+    uint8_t ep = command & 0x80000000 ? EP1_READ : EP1_WRITE;
+    int i;
+
+    fill_cbw(s->cbw, command, offset, nsectors, 0);
+    s->offset = offset;
+    s->length = length;
+    s->done = done;
+    s->failed = 0;
+    s->pending = 3;
+    s->submitted = now();
+
+    if (!tp->async) {
+        int n;
+
+        if (tp->bulk(EP1_WRITE, s->cbw, sizeof(s->cbw), &n, 0) ||
+            tp->bulk(ep, s->data, length, &n, 0) || n != length ||
+            tp->bulk(EP1_READ, s->csw, sizeof(s->csw), &n, 0) ||
+            memcmp(s->csw, "USBS", 4) || s->csw[12])
+            s->failed = 1;
+        s->pending = 0;
+        s->completed = now();
+        aio_used++;
+        return;
+    }
+
+    libusb_fill_bulk_transfer(s->xfer[0], h, EP1_WRITE, s->cbw, sizeof(s->cbw), aio_callback, s, 0);
+    libusb_fill_bulk_transfer(s->xfer[1], h, ep, s->data, length, aio_callback, s, 0);
+    libusb_fill_bulk_transfer(s->xfer[2], h, EP1_READ, s->csw, sizeof(s->csw), aio_callback, s, 0);
+
+    for (i = 0; i < 3; i++)
+        if (libusb_submit_transfer(s->xfer[i]) < 0)
+            fatal("cannot submit transfer\n");
+    aio_used++;
+}
+
+/* Queue a slot without any transfers, so that done() still runs in order */
+static void aio_defer(struct aio_slot *s, void (*done)(struct aio_slot *))
+{
+    s->done = done;
+    s->failed = 0;
+    s->pending = 0;
+    s->submitted = 0;
+    aio_used++;
+}
+
+static void aio_flush(void)
+{
+    while (aio_used)
+        aio_retire();
+}
+
+/*
+ * Android sparse images
+ *
+ * w accepts sparse images on stdin: RAW chunks are streamed, FILL chunks
+ * are expanded on the fly and DONT_CARE chunks are skipped without
+ * sending anything.  With --sparse, r writes a sparse image in which
+ * every 4KB block consisting of one repeated 32-bit word (erased or
+ * zeroed flash) becomes part of a FILL chunk instead of being written.
+ */
+#define SPARSE_MAGIC        0xed26ff3a
+#define SPARSE_HEADER_LEN   28
+#define SPARSE_CHUNK_LEN    12
+#define SPARSE_BLOCK        4096
+#define CHUNK_TYPE_RAW      0xcac1
+#define CHUNK_TYPE_FILL     0xcac2
+#define CHUNK_TYPE_DONTCARE 0xcac3
+#define CHUNK_TYPE_CRC32    0xcac4
+
+static int sparse_out, sparse_type, sparse_tail_len;
+static off_t sparse_start, sparse_chunk_pos;
+static uint32_t sparse_blocks, sparse_chunks, sparse_run;
+static uint8_t sparse_fill[4], sparse_tail[SPARSE_BLOCK];
+
+static void write_out(const void *data, int length)
+{
+    if (write(STDOUT_FILENO, data, length) != length)
+        fatal("Write error! Disk full?\n");
+}
+
+static void write_out_at(off_t pos, const void *data, int length)
+{
+    off_t cur = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+
+    if (cur == -1 || lseek(STDOUT_FILENO, pos, SEEK_SET) == -1)
+        fatal("cannot seek in output: %s\n", strerror(errno));
+    write_out(data, length);
+    lseek(STDOUT_FILENO, cur, SEEK_SET);
+}
+
+static void sparse_chunk_header(uint8_t *p, int type, uint32_t blocks, uint32_t bytes)
+{
+    memset(p, 0, SPARSE_CHUNK_LEN);
+    PUT16LE(p, type);
+    PUT32LE(p + 4, blocks);
+    PUT32LE(p + 8, bytes);
+}
+
+static void sparse_close_chunk(void)
+{
+    uint8_t hdr[SPARSE_CHUNK_LEN + 4];
+
+    if (sparse_type == CHUNK_TYPE_RAW) {
+        sparse_chunk_header(hdr, CHUNK_TYPE_RAW, sparse_run,
+                            SPARSE_CHUNK_LEN + sparse_run * SPARSE_BLOCK);
+        write_out_at(sparse_chunk_pos, hdr, SPARSE_CHUNK_LEN);
+    } else if (sparse_type == CHUNK_TYPE_FILL) {
+        sparse_chunk_header(hdr, CHUNK_TYPE_FILL, sparse_run, SPARSE_CHUNK_LEN + 4);
+        memcpy(hdr + SPARSE_CHUNK_LEN, sparse_fill, 4);
+        write_out(hdr, sizeof(hdr));
+    } else
+        return;
+    sparse_blocks += sparse_run;
+    sparse_chunks++;
+    sparse_type = 0;
+}
+
+static void sparse_put_block(const uint8_t *p)
+{
+    uint8_t hdr[SPARSE_CHUNK_LEN];
+
+    /* One 32-bit word repeated over the whole block? */
+    if (!memcmp(p, p + 4, SPARSE_BLOCK - 4)) {
+        if (sparse_type != CHUNK_TYPE_FILL || memcmp(sparse_fill, p, 4)) {
+            sparse_close_chunk();
+            sparse_type = CHUNK_TYPE_FILL;
+            memcpy(sparse_fill, p, 4);
+            sparse_run = 0;
+        }
+        sparse_run++;
+        return;
+    }
+
+    if (sparse_type != CHUNK_TYPE_RAW) {
+        sparse_close_chunk();
+        if ((sparse_chunk_pos = lseek(STDOUT_FILENO, 0, SEEK_CUR)) == -1)
+            fatal("cannot seek in output: %s\n", strerror(errno));
+        memset(hdr, 0, sizeof(hdr));
+        write_out(hdr, sizeof(hdr));
+        sparse_type = CHUNK_TYPE_RAW;
+        sparse_run = 0;
+    }
+    write_out(p, SPARSE_BLOCK);
+    sparse_run++;
+}
+
+static void sparse_begin(void)
+{
+    uint8_t hdr[SPARSE_HEADER_LEN];
+
+    if ((sparse_start = lseek(STDOUT_FILENO, 0, SEEK_CUR)) == -1)
+        fatal("--sparse needs a seekable output\n");
+    memset(hdr, 0, sizeof(hdr));
+    write_out(hdr, sizeof(hdr));
+    sparse_type = sparse_tail_len = 0;
+    sparse_blocks = sparse_chunks = 0;
+}
+
+static void sparse_end(void)
+{
+    uint8_t hdr[SPARSE_HEADER_LEN];
+
+    if (sparse_tail_len) {
+        info("padding sparse image to a whole block\n");
+        memset(sparse_tail + sparse_tail_len, 0, SPARSE_BLOCK - sparse_tail_len);
+        sparse_put_block(sparse_tail);
+    }
+    sparse_close_chunk();
+
+    memset(hdr, 0, sizeof(hdr));
+    PUT32LE(hdr, SPARSE_MAGIC);
+    PUT16LE(hdr + 4, 1);
+    PUT16LE(hdr + 6, 0);
+    PUT16LE(hdr + 8, SPARSE_HEADER_LEN);
+    PUT16LE(hdr + 10, SPARSE_CHUNK_LEN);
+    PUT32LE(hdr + 12, SPARSE_BLOCK);
+    PUT32LE(hdr + 16, sparse_blocks);
+    PUT32LE(hdr + 20, sparse_chunks);
+    write_out_at(sparse_start, hdr, sizeof(hdr));
+    info("sparse image: %u blocks in %u chunks\n", sparse_blocks, sparse_chunks);
+}
+
+/* Write data read from the device to stdout, raw or as sparse image */
+static void output_block(const uint8_t *data, int length)
+{
+    int n;
+
+    if (!sparse_out) {
+        write_out(data, length);
+        return;
+    }
+    if (sparse_tail_len) {
+        n = SPARSE_BLOCK - sparse_tail_len < length ? SPARSE_BLOCK - sparse_tail_len : length;
+        memcpy(sparse_tail + sparse_tail_len, data, n);
+        sparse_tail_len += n;
+        data += n;
+        length -= n;
+        if (sparse_tail_len < SPARSE_BLOCK)
+            return;
+        sparse_put_block(sparse_tail);
+        sparse_tail_len = 0;
+    }
+    for (; length >= SPARSE_BLOCK; data += SPARSE_BLOCK, length -= SPARSE_BLOCK)
+        sparse_put_block(data);
+    memcpy(sparse_tail, data, length);
+    sparse_tail_len = length;
+}
+
+/*
+ * Running digests
+ *
+ * r and w report the rkcrc32 and SHA-256 of all sectors they transferred,
+ * so an image can be audited without a second pass.  The data is copied
+ * into a few chunks and hashed by a worker thread, off the USB path.
+ */
+#define DIGEST_CHUNKS   4
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t *chunk[DIGEST_CHUNKS];
+    int length[DIGEST_CHUNKS];
+    int size, head, filled, running;
+    uint64_t bytes;
+    uint32_t crc;
+    struct sha256 sha;
+} digest;
+
+static void *digest_worker(void *arg)
+{
+    int i;
+
+    (void)arg;
+    pthread_mutex_lock(&digest.lock);
+    for (;;) {
+        while (!digest.filled && digest.running)
+            pthread_cond_wait(&digest.cond, &digest.lock);
+        if (!digest.filled)
+            break;
+        i = digest.head;
+        pthread_mutex_unlock(&digest.lock);
+
+        digest.crc = rkcrc32(digest.crc, digest.chunk[i], digest.length[i]);
+        sha256_update(&digest.sha, digest.chunk[i], digest.length[i]);
+
+        pthread_mutex_lock(&digest.lock);
+        digest.head = (digest.head + 1) % DIGEST_CHUNKS;
+        digest.filled--;
+        pthread_cond_broadcast(&digest.cond);
+    }
+    pthread_mutex_unlock(&digest.lock);
+    return NULL;
+}
+
+static void digest_start(int size)
+{
+    int i;
+
+    for (i = 0; i < DIGEST_CHUNKS; i++)
+        if (!(digest.chunk[i] = malloc(size)))
+            fatal("out of memory\n");
+    digest.size = size;
+    digest.head = digest.filled = 0;
+    digest.running = 1;
+    digest.bytes = 0;
+    digest.crc = 0;
+    sha256_init(&digest.sha);
+    pthread_mutex_init(&digest.lock, NULL);
+    pthread_cond_init(&digest.cond, NULL);
+    if (pthread_create(&digest.thread, NULL, digest_worker, NULL))
+        fatal("cannot create digest thread\n");
+}
+
+static void digest_update(const uint8_t *data, int length)
+{
+    int i, n;
+
+    for (; length > 0; data += n, length -= n) {
+        n = length < digest.size ? length : digest.size;
+        pthread_mutex_lock(&digest.lock);
+        while (digest.filled == DIGEST_CHUNKS)
+            pthread_cond_wait(&digest.cond, &digest.lock);
+        i = (digest.head + digest.filled) % DIGEST_CHUNKS;
+        pthread_mutex_unlock(&digest.lock);
+
+        memcpy(digest.chunk[i], data, n);
+        digest.length[i] = n;
+        digest.bytes += n;
+
+        pthread_mutex_lock(&digest.lock);
+        digest.filled++;
+        pthread_cond_broadcast(&digest.cond);
+        pthread_mutex_unlock(&digest.lock);
+    }
+}
+
+static void digest_finish(void)
+{
+    uint8_t sha[SHA256_LENGTH];
+    char hex[2 * SHA256_LENGTH + 1];
+    int i;
+
+    pthread_mutex_lock(&digest.lock);
+    digest.running = 0;
+    pthread_cond_broadcast(&digest.cond);
+    pthread_mutex_unlock(&digest.lock);
+    pthread_join(digest.thread, NULL);
+
+    sha256_final(&digest.sha, sha);
+    for (i = 0; i < SHA256_LENGTH; i++)
+        sprintf(hex + 2 * i, "%02x", sha[i]);
+    info("%llu bytes, crc32 %08x, sha256 %s\n",
+         (unsigned long long)digest.bytes, digest.crc, hex);
+
+    for (i = 0; i < DIGEST_CHUNKS; i++)
+        free(digest.chunk[i]);
+}
+
+static void journal_advance(uint32_t offset, const uint8_t *data, int length);
+
+static void aio_write_stdout(struct aio_slot *s)
+{
+    digest_update(s->data, s->length);
+    output_block(s->data, s->length);
+    journal_advance(s->offset, s->data, s->length);
+}
+
+/*
+ * Transfer size autotuning
+ *
+ * The CBW sector count is 16 bits wide, but loaders differ in how much
+ * they accept per command.  Probe ReadLBA at increasing sizes, settle on
+ * the fastest size that transferred cleanly and remember it per chip and
+ * loader version.  Only reads are probed, writes use the same size.
+ */
+#define RKFT_PROBE_ROUNDS   4
+#define RKFT_PROBE_TIMEOUT  2000        /* ms */
+
+static int probe_read(int length)
+{
+    int n;
+
+    fill_cbw(cbw, RKFT_CMD_READLBA, 0, length >> 9, 0);
+    if (tp->bulk(EP1_WRITE, cbw, sizeof(cbw), &n, RKFT_PROBE_TIMEOUT) ||
+        tp->bulk(EP1_READ, buf, length, &n, RKFT_PROBE_TIMEOUT) ||
+        n != length ||
+        tp->bulk(EP1_READ, csw, sizeof(csw), &n, RKFT_PROBE_TIMEOUT) ||
+        n != sizeof(csw) || memcmp(csw, "USBS", 4) || csw[12])
+        return -1;
+    return 0;
+}
+
+static const char *blocksize_cache(void)
+{
+    static char path[PATH_MAX];
+    const char *home = getenv("HOME");
+
+    if (!home)
+        return NULL;
+    snprintf(path, sizeof(path), "%s/.rkflashtool_blocksize", home);
+    return path;
+}
+
+static int blocksize_cache_lookup(const char *key)
+{
+    const char *path = blocksize_cache();
+    char k[128];
+    int value, found = 0;
+    FILE *f;
+
+    if (!path || !(f = fopen(path, "r")))
+        return 0;
+    /* ignore entries --blocksize would not accept */
+    while (fscanf(f, "%127s %i", k, &value) == 2)
+        if (!strcmp(k, key) && value >= 512 && value <= RKFT_MAX_BLOCKSIZE &&
+            !(value & 511))
+            found = value;
+    fclose(f);
+    return found;
+}
+
+static void blocksize_cache_store(const char *key, int value)
+{
+    const char *path = blocksize_cache();
+    char k[128], tmppath[PATH_MAX];
+    int v;
+    FILE *in, *out;
+
+    /* per process: --all workers may store at the same time */
+    if (!path || snprintf(tmppath, sizeof(tmppath), "%s.%d", path,
+                          (int)getpid()) >= (int)sizeof(tmppath))
+        return;
+    if (!(out = fopen(tmppath, "w"))) {
+        info("cannot write %s: %s\n", tmppath, strerror(errno));
+        return;
+    }
+    if ((in = fopen(path, "r"))) {
+        while (fscanf(in, "%127s %i", k, &v) == 2)
+            if (strcmp(k, key))
+                fprintf(out, "%s %#x\n", k, v);
+        fclose(in);
+    }
+    fprintf(out, "%s %#x\n", key, value);
+    if (fclose(out) || rename(tmppath, path)) {
+        info("cannot write %s: %s\n", path, strerror(errno));
+        unlink(tmppath);
+    }
+}
+
+/* Chip, loader version and chip info, as "RK3288-0100-3838..." */
+static void device_key(char *key, int len, const char *chip, uint16_t loader)
+{
+    int i, n;
+
+    send_cbw(RKFT_CMD_READCHIPINFO, 0, 0, 0);
+    recv_buf(16);
+    recv_csw();
+    n = snprintf(key, len, "%s-%04x-", chip, loader);
+    for (i = 0; i < 16 && n < len; i++)
+        n += snprintf(key + n, len - n, "%02x", buf[i]);
+}
+
+static void autotune_blocksize(const char *chip, uint16_t loader)
+{
+    char key[128];
+    int i, length, best = RKFT_BLOCKSIZE;
+    double t, rate, best_rate = 0;
+
+    device_key(key, sizeof(key), chip, loader);
+    if ((blocksize = blocksize_cache_lookup(key)) > 0) {
+        info("using cached block size %#x\n", blocksize);
+        return;
+    }
+
+    for (length = RKFT_BLOCKSIZE; length <= RKFT_MAX_BLOCKSIZE; length <<= 1) {
+        t = now();
+        for (i = 0; i < RKFT_PROBE_ROUNDS; i++)
+            if (probe_read(length))
+                break;
+        if (i < RKFT_PROBE_ROUNDS) {
+            info("block size %#x rejected by loader\n", length);
+            tp->clear_halt(EP1_READ);
+            tp->clear_halt(EP1_WRITE);
+            break;
+        }
+        rate = (double)length * RKFT_PROBE_ROUNDS / (now() - t);
+        info("block size %#x: %.2f MB/s\n", length, rate / 1e6);
+        if (rate > best_rate) {
+            best_rate = rate;
+            best = length;
+        }
+    }
+
+    blocksize = best;
+    info("using block size %#x\n", blocksize);
+    blocksize_cache_store(key, blocksize);
+}
+
+/*
+ * Input ring for w
+ *
+ * A reader thread fills blocks from stdin while the main thread sends
+ * them to the device.  Short reads from pipes are assembled into full
+ * blocks; only the last block of the input may be short, and its tail
+ * is padded with zeroes up to the next sector boundary.  When stdin is a
+ * regular file it is mapped and blocks point straight into the mapping.
+ */
+struct block {
+    uint8_t *buffer;            /* owned by the ring slot */
+    uint8_t *data;              /* buffer, or a part of the input mapping */
+    uint32_t offset;
+    int nsectors;               /* 0 marks the end of the input */
+    uint32_t crc;               /* rkcrc32 of data, with --manifest only */
+};
+
+static struct block ring[RKFT_MAX_QUEUE + 2];
+static int ring_size, ring_head, ring_filled, ring_busy, ring_error;
+static uint32_t ring_offset;
+static int ring_sectors;
+static pthread_t ring_thread;
+static const char *manifest_path;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+
+/* Producer: wait for a free block */
+static struct block *ring_reserve(void)
+{
+    struct block *b;
+
+    pthread_mutex_lock(&ring_lock);
+    while (ring_filled + ring_busy == ring_size)
+        pthread_cond_wait(&ring_cond, &ring_lock);
+    b = &ring[(ring_head + ring_busy + ring_filled) % ring_size];
+    pthread_mutex_unlock(&ring_lock);
+    return b;
+}
+
+/* Producer: queue the block obtained from ring_reserve() */
+static void ring_commit(void)
+{
+    pthread_mutex_lock(&ring_lock);
+    ring_filled++;
+    pthread_cond_broadcast(&ring_cond);
+    pthread_mutex_unlock(&ring_lock);
+}
+
+/* Consumer: wait for the next filled block */
+static struct block *ring_take(void)
+{
+    struct block *b;
+
+    pthread_mutex_lock(&ring_lock);
+    while (!ring_filled)
+        pthread_cond_wait(&ring_cond, &ring_lock);
+    b = &ring[(ring_head + ring_busy) % ring_size];
+    ring_filled--;
+    ring_busy++;
+    pthread_mutex_unlock(&ring_lock);
+    return b;
+}
+
+/* Consumer: hand the oldest taken block back to the producer */
+static void ring_release(void)
+{
+    struct block *b = &ring[ring_head];
+
+    /* blocks are released in order, once the device acknowledged them */
+    journal_advance(b->offset, b->data, b->nsectors << 9);
+
+    pthread_mutex_lock(&ring_lock);
+    ring_head = (ring_head + 1) % ring_size;
+    ring_busy--;
+    pthread_cond_broadcast(&ring_cond);
+    pthread_mutex_unlock(&ring_lock);
+}
+
+static int read_full(int fd, uint8_t *p, int length)
+{
+    int n, got = 0;
+
+    while (got < length) {
+        if ((n = read(fd, p + got, length - got)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (!n)
+            break;
+        got += n;
+    }
+    return got;
+}
+
+/* Bytes consumed from stdin while looking for a sparse header */
+static uint8_t input_peek[SPARSE_HEADER_LEN];
+static int input_peeked;
+
+/* stdin as a regular file: its size from the current offset, and mapping */
+static int input_known;
+static uint64_t input_size, input_pos;
+static uint8_t *input_map, *input_data;
+static size_t input_map_len;
+
+static void input_open(void)
+{
+    struct stat st;
+    off_t pos;
+
+    input_known = 0;
+    input_size = input_pos = 0;
+    if (fstat(STDIN_FILENO, &st) || !S_ISREG(st.st_mode) ||
+        (pos = lseek(STDIN_FILENO, 0, SEEK_CUR)) == -1 || pos > st.st_size)
+        return;
+    input_known = 1;
+    input_size = st.st_size - pos;
+    input_pos = 0;
+    if (!input_size)
+        return;
+
+    /* without a mapping, read() still works */
+    input_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, STDIN_FILENO, 0);
+    if (input_map == MAP_FAILED) {
+        input_map = NULL;
+        return;
+    }
+    input_map_len = st.st_size;
+    input_data = input_map + pos;
+}
+
+static void input_close(void)
+{
+    if (input_map)
+        munmap(input_map, input_map_len);
+    input_map = input_data = NULL;
+    input_known = input_peeked = 0;
+    input_size = input_pos = 0;
+}
+
+/* A mapped input that is an Android sparse image */
+static int input_sparse(void)
+{
+    return input_data && input_size >= SPARSE_HEADER_LEN &&
+           (uint32_t)GET32LE(input_data) == SPARSE_MAGIC;
+}
+
+/* With a known input size, refuse an image that does not fit */
+static void input_check_size(uint32_t offset, int size)
+{
+    uint64_t bytes = input_size;
+
+    if (!input_known)
+        return;
+    if (input_sparse())
+        bytes = (uint64_t)(uint32_t)GET32LE(input_data + 16) *
+                (uint32_t)GET32LE(input_data + 12);
+    if (bytes > (uint64_t)size << 9)
+        fatal("input is %llu bytes, but only %llu bytes fit at offset 0x%08x\n",
+              (unsigned long long)bytes, (unsigned long long)size << 9, offset);
+}
+
+static int input_read(uint8_t *p, int length)
+{
+    int n = 0, r;
+
+    if (input_peeked) {
+        n = input_peeked < length ? input_peeked : length;
+        memcpy(p, input_peek, n);
+        memmove(input_peek, input_peek + n, input_peeked - n);
+        input_peeked -= n;
+    }
+    if (n < length && input_data) {
+        r = input_size - input_pos < (uint64_t)(length - n) ? (int)(input_size - input_pos) : length - n;
+        memcpy(p + n, input_data + input_pos, r);
+        input_pos += r;
+        n += r;
+    } else if (n < length) {
+        if ((r = read_full(STDIN_FILENO, p + n, length - n)) < 0)
+            return -1;
+        n += r;
+    }
+    return n;
+}
+
+/* Up to length bytes of input: from the mapping, or read into p */
+static uint8_t *input_get(uint8_t *p, int length, int *n)
+{
+    if (input_data && !input_peeked) {
+        *n = input_size - input_pos < (uint64_t)length ? (int)(input_size - input_pos) : length;
+        p = input_data + input_pos;
+        input_pos += *n;
+        return p;
+    }
+    *n = input_read(p, length);
+    return p;
+}
+
+static int input_skip(int length)
+{
+    uint8_t scratch[512];
+    int n;
+
+    for (; length > 0; length -= n)
+        if ((n = input_read(scratch, length < 512 ? length : 512)) <= 0)
+            return -1;
+    return 0;
+}
+
+/* Queue a block holding n bytes of data for offset */
+static void ring_queue(struct block *b, uint32_t offset, int n)
+{
+    if (n & 511)
+        memset(b->data + n, 0, 512 - (n & 511));
+    b->offset = offset;
+    b->nsectors = (n + 511) >> 9;
+    if (manifest_path)
+        b->crc = rkcrc32(0, b->data, b->nsectors << 9);
+    ring_commit();
+}
+
+static uint32_t raw_reader(uint32_t offset, int size)
+{
+    struct block *b;
+    int n = 0, length;
+
+    while (size > 0) {
+        length = (size < blocksize >> 9 ? size : blocksize >> 9) << 9;
+        b = ring_reserve();
+        b->data = input_get(b->buffer, length, &n);
+        if (n <= 0)
+            break;
+        if (n & 511 && b->data != b->buffer) {
+            /* the padding needs a buffer of our own */
+            memcpy(b->buffer, b->data, n);
+            b->data = b->buffer;
+        }
+        ring_queue(b, offset, n);
+        offset += b->nsectors;
+        size   -= b->nsectors;
+        if (n < length)
+            break;
+    }
+    if (n < 0)
+        ring_error = errno;
+    return offset;
+}
+
+/* Queue nsectors of RAW data from stdin, or of a FILL pattern */
+static int sparse_emit(uint32_t offset, int nsectors, const uint8_t *fill)
+{
+    struct block *b;
+    int i, n, got;
+
+    while (nsectors > 0) {
+        n = nsectors < blocksize >> 9 ? nsectors : blocksize >> 9;
+        b = ring_reserve();
+        b->data = b->buffer;
+        if (fill) {
+            for (i = 0; i < n << 9; i += 4)
+                memcpy(b->data + i, fill, 4);
+        } else {
+            b->data = input_get(b->buffer, n << 9, &got);
+            if (got != n << 9)
+                return -1;
+        }
+        ring_queue(b, offset, n << 9);
+        offset   += n;
+        nsectors -= n;
+    }
+    return 0;
+}
+
+static uint32_t sparse_reader(uint32_t offset, int size)
+{
+    uint8_t hdr[SPARSE_CHUNK_LEN], fill[4];
+    uint32_t i, chunks, blk_sectors, pos = 0;
+    int file_hdr_len, chunk_hdr_len, nsectors, length, clipped;
+
+    file_hdr_len  = GET16LE(input_peek + 8);
+    chunk_hdr_len = GET16LE(input_peek + 10);
+    blk_sectors   = GET32LE(input_peek + 12) >> 9;
+    chunks        = GET32LE(input_peek + 20);
+    input_peeked  = 0;
+
+    if (file_hdr_len < SPARSE_HEADER_LEN || chunk_hdr_len < SPARSE_CHUNK_LEN ||
+        !blk_sectors || GET32LE(input_peek + 12) & 511 ||
+        input_skip(file_hdr_len - SPARSE_HEADER_LEN))
+        goto bad;
+
+    for (i = 0; i < chunks && (int)pos < size; i++) {
+        if (input_read(hdr, SPARSE_CHUNK_LEN) != SPARSE_CHUNK_LEN ||
+            input_skip(chunk_hdr_len - SPARSE_CHUNK_LEN))
+            goto bad;
+        nsectors = GET32LE(hdr + 4) * blk_sectors;
+        length   = GET32LE(hdr + 8) - chunk_hdr_len;
+        clipped  = nsectors > size - (int)pos ? size - (int)pos : nsectors;
+
+        switch (GET16LE(hdr)) {
+        case CHUNK_TYPE_RAW:
+            if (length != nsectors << 9 || sparse_emit(offset + pos, clipped, NULL))
+                goto bad;
+            break;
+        case CHUNK_TYPE_FILL:
+            if (length != 4 || input_read(fill, 4) != 4 ||
+                sparse_emit(offset + pos, clipped, fill))
+                goto bad;
+            break;
+        case CHUNK_TYPE_DONTCARE:
+            break;
+        case CHUNK_TYPE_CRC32:
+            if (input_skip(length))
+                goto bad;
+            break;
+        default:
+            goto bad;
+        }
+        pos += clipped;
+    }
+    return offset + pos;
+
+bad:
+    info("bad or truncated sparse image\n");
+    ring_error = EINVAL;
+    return offset + pos;
+}
+
+static void *ring_reader(void *arg)
+{
+    struct block *b;
+    uint32_t end;
+
+    (void)arg;
+    if (input_data) {
+        input_peeked = input_size < SPARSE_HEADER_LEN ? input_size : SPARSE_HEADER_LEN;
+        memcpy(input_peek, input_data, input_peeked);
+        input_pos = input_peeked;
+    } else if ((input_peeked = read_full(STDIN_FILENO, input_peek, SPARSE_HEADER_LEN)) < 0) {
+        ring_error = errno;
+        input_peeked = 0;
+    }
+    if (input_peeked == SPARSE_HEADER_LEN && (uint32_t)GET32LE(input_peek) == SPARSE_MAGIC) {
+        info("sparse image detected\n");
+        if (manifest_path) {
+            /* it would not describe the device after this write */
+            info("--manifest is not used for sparse images, removing %s\n",
+                 manifest_path);
+            if (unlink(manifest_path) && errno != ENOENT)
+                info("%s: %s\n", manifest_path, strerror(errno));
+            manifest_path = NULL;
+        }
+        end = sparse_reader(ring_offset, ring_sectors);
+    } else {
+        if (input_data)     /* start over, without copying the peeked bytes */
+            input_pos = input_peeked = 0;
+        end = raw_reader(ring_offset, ring_sectors);
+    }
+
+    b = ring_reserve();
+    b->offset = end;
+    b->nsectors = 0;
+    ring_commit();
+    return NULL;
+}
+
+static void ring_start(uint32_t offset, int size)
+{
+    int i;
+
+    ring_size = queue_depth + 2;
+    for (i = 0; i < ring_size; i++)
+        if (!(ring[i].buffer = malloc(blocksize)))
+            fatal("out of memory\n");
+    ring_head = ring_filled = ring_busy = ring_error = 0;
+    ring_offset = offset;
+    ring_sectors = size;
+    if (pthread_create(&ring_thread, NULL, ring_reader, NULL))
+        fatal("cannot create reader thread\n");
+}
+
+static void ring_stop(void)
+{
+    int i;
+
+    pthread_join(ring_thread, NULL);
+    for (i = 0; i < ring_size; i++)
+        free(ring[i].buffer);
+    if (ring_error)
+        fatal("read error: %s\n", strerror(ring_error));
+}
+
+static void aio_release_block(struct aio_slot *s)
+{
+    (void)s;
+    ring_release();
+}
+
+/*
+ * Checkpoint journal for r and w
+ *
+ * The journal records the range of the command, the identity of the
+ * input file (w), how many sectors from the start the device has
+ * acknowledged and the rkcrc32 of those.  With --resume a matching
+ * journal lets the command continue after the last acknowledged block;
+ * the CRC is checked against the input (w) or the output file (r) that
+ * is already there.  The file is little endian and removed on success:
+ *
+ *   "RKJN", action, offset, nsectors, done, crc, input size (64 bit),
+ *   input mtime (64 bit)
+ */
+#define JOURNAL_MAGIC   "RKJN"
+#define JOURNAL_LEN     40
+
+static const char *journal_path, *output_path;
+static int journal_resume, journal_fd = -1;
+static struct {
+    uint32_t action, offset, size, done, crc;
+    uint64_t input_size, input_mtime;
+} journal;
+
+static void journal_write(void)
+{
+    uint8_t j[JOURNAL_LEN];
+
+    memcpy(j, JOURNAL_MAGIC, 4);
+    PUT32LE(j + 4, journal.action);
+    PUT32LE(j + 8, journal.offset);
+    PUT32LE(j + 12, journal.size);
+    PUT32LE(j + 16, journal.done);
+    PUT32LE(j + 20, journal.crc);
+    PUT32LE(j + 24, (uint32_t)journal.input_size);
+    PUT32LE(j + 28, (uint32_t)(journal.input_size >> 32));
+    PUT32LE(j + 32, (uint32_t)journal.input_mtime);
+    PUT32LE(j + 36, (uint32_t)(journal.input_mtime >> 32));
+    if (lseek(journal_fd, 0, SEEK_SET) == -1 || write(journal_fd, j, JOURNAL_LEN) != JOURNAL_LEN)
+        fatal("%s: %s\n", journal_path, strerror(errno));
+}
+
+/* Returns 1 if a journal for the same command could be loaded */
+static int journal_load(uint32_t action, uint32_t offset, int size)
+{
+    uint8_t j[JOURNAL_LEN];
+    int fd, n;
+
+    if ((fd = open(journal_path, O_RDONLY | O_BINARY)) == -1)
+        return 0;
+    n = read(fd, j, JOURNAL_LEN);
+    close(fd);
+    if (n != JOURNAL_LEN || memcmp(j, JOURNAL_MAGIC, 4))
+        fatal("%s: not a journal\n", journal_path);
+    if ((uint32_t)GET32LE(j + 4) != action || (uint32_t)GET32LE(j + 8) != offset ||
+        (uint32_t)GET32LE(j + 12) != (uint32_t)size)
+        fatal("%s: journal is for a different command\n", journal_path);
+    journal.done = GET32LE(j + 16);
+    journal.crc  = GET32LE(j + 20);
+    journal.input_size  = (uint32_t)GET32LE(j + 24) | (uint64_t)(uint32_t)GET32LE(j + 28) << 32;
+    journal.input_mtime = (uint32_t)GET32LE(j + 32) | (uint64_t)(uint32_t)GET32LE(j + 36) << 32;
+    return 1;
+}
+
+/* rkcrc32 of the first bytes of fd, or of the input mapping if fd < 0 */
+static uint32_t journal_crc(int fd, uint64_t bytes)
+{
+    uint32_t crc = 0;
+    int n;
+
+    if (fd < 0)
+        return rkcrc32(0, input_data, bytes);
+    for (; bytes; bytes -= n) {
+        n = bytes < RKFT_MAX_BLOCKSIZE ? bytes : RKFT_MAX_BLOCKSIZE;
+        if (read_full(fd, buf, n) != n)
+            return ~crc;
+        crc = rkcrc32(crc, buf, n);
+    }
+    return crc;
+}
+
+/*
+ * Set up the journal before r or w starts and, with --resume, move
+ * offset and size past what is already done.
+ */
+static void journal_start(char action, uint32_t *offset, int *size)
+{
+    struct stat st;
+    uint64_t bytes;
+    int fd;
+
+    if (action == 'r' && (!output_path || sparse_out))
+        fatal("--journal needs --output for r, and no --sparse\n");
+    if (action == 'w' && (!input_known || fstat(STDIN_FILENO, &st)))
+        fatal("--journal needs the input of w in a regular file\n");
+    if (action == 'w' && input_sparse()) {
+        info("--journal is not used for sparse images\n");
+        return;
+    }
+
+    memset(&journal, 0, sizeof(journal));
+    if (journal_resume && journal_load(action, *offset, *size)) {
+        bytes = (uint64_t)journal.done << 9;
+        if (action == 'w') {
+            if (journal.input_size != input_size ||
+                journal.input_mtime != (uint64_t)st.st_mtime)
+                fatal("%s: input file changed since the journal was written\n",
+                      journal_path);
+            if (journal_crc(input_data ? -1 : STDIN_FILENO, bytes) != journal.crc)
+                fatal("%s: input does not match the journal\n", journal_path);
+            if (input_data) {
+                input_data += bytes;
+                input_size -= bytes;
+            } else
+                input_size -= bytes;
+        } else {
+            if ((fd = open(output_path, O_RDONLY | O_BINARY)) == -1)
+                fatal("%s: %s\n", output_path, strerror(errno));
+            if (journal_crc(fd, bytes) != journal.crc)
+                fatal("%s: output does not match the journal\n", journal_path);
+            close(fd);
+            if (ftruncate(STDOUT_FILENO, bytes) || lseek(STDOUT_FILENO, bytes, SEEK_SET) == -1)
+                fatal("%s: %s\n", output_path, strerror(errno));
+        }
+        info("resuming at offset 0x%08x, %u sectors already done\n",
+             *offset + journal.done, journal.done);
+    } else {
+        if (journal_resume)
+            info("no journal yet, starting from the beginning\n");
+        /* --resume opened the output without O_TRUNC */
+        if (action == 'r' && journal_resume && ftruncate(STDOUT_FILENO, 0))
+            fatal("%s: %s\n", output_path, strerror(errno));
+        journal.action = action;
+        journal.offset = *offset;
+        journal.size = *size;
+        if (action == 'w') {
+            journal.input_size = input_size;
+            journal.input_mtime = st.st_mtime;
+        }
+    }
+
+    if ((journal_fd = open(journal_path, O_RDWR | O_CREAT | O_BINARY, 0644)) == -1)
+        fatal("%s: %s\n", journal_path, strerror(errno));
+    journal.action = action;
+    journal.offset = *offset;
+    journal.size = *size;
+    journal_write();
+
+    *offset += journal.done;
+    *size -= journal.done;
+}
+
+/* length bytes at offset were acknowledged by the device */
+static void journal_advance(uint32_t offset, const uint8_t *data, int length)
+{
+    if (journal_fd < 0 || offset != journal.offset + journal.done)
+        return;
+    journal.crc = rkcrc32(journal.crc, (uint8_t *)data, length);
+    journal.done += length >> 9;
+    journal_write();
+}
+
+static void journal_finish(void)
+{
+    if (journal_fd < 0)
+        return;
+    close(journal_fd);
+    journal_fd = -1;
+    unlink(journal_path);
+}
+
+/*
+ * Verify after write
+ *
+ * With --verify every block written is read back and compared before its
+ * ring slot is given back.  With a queue the read is queued right behind
+ * the write, so it overlaps with the following writes.
+ */
+static int verify;
+static uint64_t verified;
+
+static void verify_block(uint32_t offset, const uint8_t *expect,
+                         const uint8_t *data, int length)
+{
+    int i;
+
+    for (i = 0; i < length; i += 512)
+        if (memcmp(expect + i, data + i, length - i < 512 ? length - i : 512))
+            fatal("verify failed at offset 0x%08x\n", offset + i / 512);
+    verified += length;
+}
+
+static void aio_verify_block(struct aio_slot *s)
+{
+    struct block *b = s->user;
+
+    verify_block(b->offset, b->data, s->data, s->length);
+    ring_release();
+}
+
+/*
+ * Block hash manifest for delta flashing
+ *
+ * The manifest records what w last put on the device: the start sector,
+ * the block size, the device (USB path and the key of device_key) and
+ * the rkcrc32 of every block.  Blocks whose hash did not change are not
+ * sent again.  It only knows about its own writes: anything else written
+ * to the range since makes it wrong.  The file is little endian:
+ *
+ *   "RKHM", offset, blocksize, count, device (128 bytes, NUL padded),
+ *   count * crc32
+ */
+#define MANIFEST_ID_LEN 128
+
+static uint32_t *manifest, manifest_offset;
+static int manifest_blocks, manifest_readback, manifest_skipped;
+static char manifest_id[MANIFEST_ID_LEN];
+
+static void manifest_load(uint32_t offset, int size, const char *chip, uint16_t loader)
+{
+    uint8_t hdr[16 + MANIFEST_ID_LEN];
+    int i, fd;
+
+    memset(manifest_id, 0, sizeof(manifest_id));
+    i = snprintf(manifest_id, sizeof(manifest_id), "%s:", device_location);
+    if (i < (int)sizeof(manifest_id))
+        device_key(manifest_id + i, sizeof(manifest_id) - i, chip, loader);
+
+    manifest_blocks = (size + (blocksize >> 9) - 1) / (blocksize >> 9);
+    manifest_offset = offset;
+    if (!(manifest = calloc(manifest_blocks ? manifest_blocks : 1, sizeof(uint32_t))))
+        fatal("out of memory\n");
+
+    if ((fd = open(manifest_path, O_RDONLY | O_BINARY)) == -1) {
+        manifest_blocks = 0;
+        return;
+    }
+    if (read_full(fd, hdr, sizeof(hdr)) != (int)sizeof(hdr) || memcmp(hdr, "RKHM", 4) ||
+        (uint32_t)GET32LE(hdr + 4) != offset || (int)GET32LE(hdr + 8) != blocksize ||
+        memcmp(hdr + 16, manifest_id, MANIFEST_ID_LEN)) {
+        info("%s is for another range or device, ignoring it\n", manifest_path);
+        manifest_blocks = 0;
+    } else {
+        if ((int)GET32LE(hdr + 12) < manifest_blocks)
+            manifest_blocks = GET32LE(hdr + 12);
+        for (i = 0; i < manifest_blocks; i++) {
+            if (read_full(fd, hdr, 4) != 4)
+                break;
+            manifest[i] = GET32LE(hdr);
+        }
+        manifest_blocks = i;
+    }
+    close(fd);
+}
+
+static void manifest_hash_block(struct aio_slot *s)
+{
+    manifest[(s->offset - manifest_offset) / (blocksize >> 9)] = rkcrc32(0, s->data, s->length);
+}
+
+/* Without a usable manifest, hash what is on the device right now */
+static void manifest_read_device(int size)
+{
+    uint32_t offset = manifest_offset;
+    int nsectors;
+
+    aio_init(blocksize);
+    while (size > 0) {
+        nsectors = size < blocksize >> 9 ? size : blocksize >> 9;
+        infocr("hashing flash memory at offset 0x%08x", offset);
+        aio_submit(aio_get(), RKFT_CMD_READLBA, offset, nsectors,
+                   nsectors << 9, manifest_hash_block);
+        offset += nsectors;
+        size   -= nsectors;
+        manifest_blocks++;
+    }
+    aio_flush();
+    aio_free();
+    fprintf(stderr, "... Done!\n");
+}
+
+/* Returns 1 if the block is unchanged, otherwise records its new hash */
+static int manifest_check(struct block *b)
+{
+    int i = (b->offset - manifest_offset) / (blocksize >> 9);
+
+    if (i < manifest_blocks && manifest[i] == b->crc)
+        return 1;
+    manifest[i] = b->crc;
+    return 0;
+}
+
+static void manifest_save(int written)
+{
+    uint8_t hdr[16 + MANIFEST_ID_LEN];
+    char tmppath[PATH_MAX];
+    int i, fd, count = written > manifest_blocks ? written : manifest_blocks;
+
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", manifest_path);
+    if ((fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644)) == -1)
+        fatal("%s: %s\n", tmppath, strerror(errno));
+    memcpy(hdr, "RKHM", 4);
+    PUT32LE(hdr + 4, manifest_offset);
+    PUT32LE(hdr + 8, blocksize);
+    PUT32LE(hdr + 12, count);
+    memcpy(hdr + 16, manifest_id, MANIFEST_ID_LEN);
+    if (write(fd, hdr, sizeof(hdr)) != sizeof(hdr))
+        fatal("%s: write error\n", tmppath);
+    for (i = 0; i < count; i++) {
+        PUT32LE(hdr, manifest[i]);
+        if (write(fd, hdr, 4) != 4)
+            fatal("%s: write error\n", tmppath);
+    }
+    if (close(fd) || rename(tmppath, manifest_path))
+        fatal("%s: %s\n", manifest_path, strerror(errno));
+}
+
+/*
+ * Flashing
+ */
+
+/* Write the blocks of the input to offset; returns the end of the data */
+static uint32_t write_flash(uint32_t offset, int size, uint8_t flag)
+{
+    struct block *b;
+    uint64_t total = 0;
+    double start = now();
+
+    verified = 0;
+    ring_start(offset, size);
+    digest_start(blocksize);
+    if (queue_depth > 1)
+        aio_init(verify ? blocksize : 0);
+
+    while ((b = ring_take())->nsectors) {
+        digest_update(b->data, b->nsectors << 9);
+
+        /* 跳过设备上内容未变的块 */
+        if (manifest_path && manifest_check(b)) {
+            manifest_skipped++;
+            if (queue_depth > 1)
+                aio_defer(aio_get(), aio_release_block);
+            else
+                ring_release();
+            continue;
+        }
+
+        infocr("writing flash memory at offset 0x%08x", b->offset);
+        total += b->nsectors << 9;
+
+        /* 写lba + offset, 每次最多传输blocksize */
+        if (queue_depth > 1) {
+            struct aio_slot *s = aio_get();
+            s->data = b->data;
+            aio_submit(s, RKFT_CMD_WRITELBA, b->offset, b->nsectors,
+                       b->nsectors << 9, verify ? NULL : aio_release_block);
+            if (verify) {
+                s = aio_get();
+                s->user = b;
+                aio_submit(s, RKFT_CMD_READLBA, b->offset, b->nsectors,
+                           b->nsectors << 9, aio_verify_block);
+            }
+        } else {
+            send_cbw(RKFT_CMD_WRITELBA, b->offset, b->nsectors, flag);
+            tp->bulk(EP1_WRITE, b->data, b->nsectors << 9, &tmp, 0);
+            check_csw("write", b->offset);
+            if (verify) {
+                send_cbw(RKFT_CMD_READLBA, b->offset, b->nsectors, flag);
+                recv_buf(b->nsectors << 9);
+                check_csw("read", b->offset);
+                verify_block(b->offset, b->data, buf, b->nsectors << 9);
+            }
+            ring_release();
+        }
+    }
+    if (queue_depth > 1) {
+        aio_flush();
+        aio_free();
+    }
+    ring_stop();
+
+    fprintf(stderr, "... Done!\n");
+    report_rate("wrote", total, start);
+    if (verify)
+        info("%llu bytes verified\n", (unsigned long long)verified);
+    digest_finish();
+    return b->offset;
+}
+
+/* Write a parameter file with its header and CRC to all its copies */
+static void write_parameters(const uint8_t *text, int length, uint8_t flag)
+{
+    uint32_t offset, crc;
+
+    if (length > RKFT_BLOCKSIZE - 12)
+        fatal("parameter file too large\n");
+
+    /* Header */
+    memmove(buf + 8, text, length);
+    memcpy(buf, "PARM", 4);
+
+    /* Length */
+    PUT32LE(buf + 4, length);
+
+    /* CRC */
+    crc = rkcrc32(0, buf + 8, length);
+    PUT32LE(buf + 8 + length, crc);
+
+    /*
+     * The parameter file is written at 8 different offsets:
+     * 0x0000, 0x0400, 0x0800, 0x0C00, 0x1000, 0x1400, 0x1800, 0x1C00
+     */
+
+    for(offset = 0; offset < 0x2000; offset += 0x400) {
+        infocr("writing flash memory at offset 0x%08x", offset);
+        send_cbw(RKFT_CMD_WRITELBA, offset, RKFT_OFF_INCR, flag);
+        send_buf(RKFT_BLOCKSIZE);
+        check_csw("write", offset);
+    }
+
+    if (verify) {
+        uint8_t *param = malloc(RKFT_BLOCKSIZE);
+
+        if (!param)
+            fatal("out of memory\n");
+        memcpy(param, buf, RKFT_BLOCKSIZE);
+        for (offset = 0; offset < 0x2000; offset += 0x400) {
+            infocr("verifying flash memory at offset 0x%08x", offset);
+            send_cbw(RKFT_CMD_READLBA, offset, RKFT_OFF_INCR, flag);
+            recv_buf(RKFT_BLOCKSIZE);
+            check_csw("read", offset);
+            verify_block(offset, param, buf, RKFT_BLOCKSIZE);
+        }
+        free(param);
+    }
+}
+
+/*
+ * Partition table
+ *
+ * The partitions come from the mtdparts= of the parameter block at LBA 0
+ * or, on newer boards, from a GPT (header at LBA 1).  A parsed table is
+ * cached in ~/.rkflashtool_partitions, keyed by the location of the
+ * device and the CRC32 of the parameter block (or of the GPT header), so
+ * a lookup by name costs a single short read when the table is known.
+ * A partition that extends to the end of the flash ("-" in mtdparts)
+ * is stored with size 0, and sized with READFLASHINFO when it is loaded:
+ * the same parameter block may be on flashes of different sizes.
+ */
+#define RKFT_MAX_PARTITIONS 128
+#define GPT_HEADER_SIGNATURE "EFI PART"
+
+struct partition {
+    char name[64];
+    uint32_t offset, size;
+    int to_end;             /* size 0 in mtdparts or the cache */
+};
+
+static struct partition partitions[RKFT_MAX_PARTITIONS];
+static int partition_count = -1;
+static char partition_key[160];
+static char parameters[MAX_PARAM_LENGTH + 1];
+
+static int partition_add(const char *name, int length, uint32_t offset, uint32_t size)
+{
+    struct partition *part;
+
+    if (partition_count >= RKFT_MAX_PARTITIONS) {
+        info("Error: more than %d partitions.\n", RKFT_MAX_PARTITIONS);
+        return -1;
+    }
+    part = &partitions[partition_count++];
+    if (length >= (int)sizeof(part->name))
+        length = sizeof(part->name) - 1;
+    memcpy(part->name, name, length);
+    part->name[length] = '\0';
+    part->offset = offset;
+    part->size   = size;
+    part->to_end = !size;
+    return 0;
+}
+
+/* Size of the flash in sectors */
+static uint32_t flash_size(uint8_t flag)
+{
+    send_cbw(RKFT_CMD_READFLASHINFO, 0, 0, flag);
+    recv_buf(512);
+    recv_csw();
+
+    return ((nand_info *) buf)->flash_size;
+}
+
+/* Size the partitions that extend to the end of the flash */
+static void partitions_resolve(uint8_t flag)
+{
+    uint32_t end = 0;
+    int i;
+
+    for (i = 0; i < partition_count; i++)
+        if (partitions[i].to_end) {
+            if (!end)
+                end = flash_size(flag);
+            partitions[i].size = end - partitions[i].offset;
+        }
+}
+
+/*
+ * Parse "mtdparts=id:size@offset(name),...,-@offset(name)" of a parameter
+ * file into the table.  Returns -1 on a syntax error.
+ */
+static int mtdparts_parse(const char *param, uint8_t flag)
+{
+    const char *p, *name;
+    uint32_t offset, size;
+    char *q;
+
+    partition_count = 0;
+    if (!(p = strstr(param, "mtdparts=")) || !(p = strchr(p, ':'))) {
+        info("Error: 'mtdparts' not found in command line.\n");
+        return -1;
+    }
+    do {
+        p++;
+        if (*p == '-') {
+            /* up to the end of the flash */
+            size = 0;
+            p++;
+        } else {
+            size = strtoul(p, &q, 0);
+            p = q;
+        }
+        if (*p != '@') {
+            info("Error: Bad syntax in mtdparts.\n");
+            return -1;
+        }
+        offset = strtoul(p + 1, &q, 0);
+        if (*q != '(' || !(p = strchr(name = q + 1, ')'))) {
+            info("Error: Bad syntax in mtdparts.\n");
+            return -1;
+        }
+        if (partition_add(name, p - name, offset, size))
+            return -1;
+        p++;
+    } while (*p == ',');
+    partitions_resolve(flag);
+    return 0;
+}
+
+/* Parse the GPT whose header is at hdr (in buf) into the table */
+static int gpt_parse(const uint8_t *hdr, uint8_t flag)
+{
+    uint32_t lba, entries, entry_size, i, j, n, nsectors;
+    uint8_t *e;
+    char name[37];
+    static const uint8_t unused[16];
+
+    lba        = GET32LE(hdr + 72);
+    entries    = GET32LE(hdr + 80);
+    entry_size = GET32LE(hdr + 84);
+    if (entry_size < 128 || entry_size > 512 || 512 % entry_size ||
+        entries > 1024 || GET32LE(hdr + 76)) {
+        info("Error: Bad GPT header.\n");
+        return -1;
+    }
+
+    partition_count = 0;
+    for (i = 0; i < entries; ) {
+        nsectors = ((entries - i) * entry_size + 511) >> 9;
+        if (nsectors > RKFT_OFF_INCR)
+            nsectors = RKFT_OFF_INCR;
+        send_cbw(RKFT_CMD_READLBA, lba, nsectors, flag);
+        recv_buf(nsectors << 9);
+        check_csw("read", lba);
+        lba += nsectors;
+
+        for (e = buf; e < buf + (nsectors << 9) && i < entries; e += entry_size, i++) {
+            if (!memcmp(e, unused, 16))
+                continue;
+            if (GET32LE(e + 36) || GET32LE(e + 44)) {
+                info("Error: GPT partition beyond 2TB.\n");
+                return -1;
+            }
+            /* UTF-16LE, keep it if it is ASCII */
+            for (j = n = 0; j < 36 && GET16LE(e + 56 + 2 * j); j++)
+                name[n++] = GET16LE(e + 56 + 2 * j) < 0x80 ? e[56 + 2 * j] : '?';
+            if (partition_add(name, n, GET32LE(e + 32),
+                              (uint32_t)GET32LE(e + 40) - GET32LE(e + 32) + 1))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static const char *partition_cache(void)
+{
+    static char path[PATH_MAX];
+    const char *home = getenv("HOME");
+
+    if (!home)
+        return NULL;
+    snprintf(path, sizeof(path), "%s/.rkflashtool_partitions", home);
+    return path;
+}
+
+/* Lines of "key offset size name", one per partition */
+static int partition_cache_lookup(const char *key)
+{
+    const char *path = partition_cache();
+    char k[160], name[64];
+    unsigned int offset, size;
+    FILE *f;
+
+    if (!path || !(f = fopen(path, "r")))
+        return -1;
+    partition_count = 0;
+    while (fscanf(f, "%159s %i %i %63[^\n]", k, &offset, &size, name) == 4)
+        if (!strcmp(k, key) && partition_add(name, strlen(name), offset, size))
+            break;
+    fclose(f);
+    return partition_count ? 0 : -1;
+}
+
+/* Replace what is cached for this device with the table */
+static void partition_cache_store(const char *key)
+{
+    const char *path = partition_cache();
+    char k[160], name[64], tmppath[PATH_MAX];
+    unsigned int offset, size;
+    int i, n = strrchr(key, ':') - key + 1;
+    FILE *in, *out;
+
+    /* per process: --all workers may store at the same time */
+    if (!path || snprintf(tmppath, sizeof(tmppath), "%s.%d", path,
+                          (int)getpid()) >= (int)sizeof(tmppath))
+        return;
+    if (!(out = fopen(tmppath, "w"))) {
+        info("cannot write %s: %s\n", tmppath, strerror(errno));
+        return;
+    }
+    if ((in = fopen(path, "r"))) {
+        while (fscanf(in, "%159s %i %i %63[^\n]", k, &offset, &size, name) == 4)
+            if (strncmp(k, key, n))
+                fprintf(out, "%s %#010x %#010x %s\n", k, offset, size, name);
+        fclose(in);
+    }
+    for (i = 0; i < partition_count; i++)
+        fprintf(out, "%s %#010x %#010x %s\n", key, partitions[i].offset,
+                partitions[i].to_end ? 0 : partitions[i].size, partitions[i].name);
+    if (fclose(out) || rename(tmppath, path)) {
+        info("cannot write %s: %s\n", path, strerror(errno));
+        unlink(tmppath);
+    }
+}
+
+static void partition_key_set(uint32_t crc)
+{
+    snprintf(partition_key, sizeof(partition_key), "%s:%08x", device_location, crc);
+}
+
+/* Read the parameter block of the device, returns its text */
+static const char *read_parameters(uint8_t flag)
+{
+    uint32_t size;
+
+    /*
+     * 发送读LBA命令后得到返回结果,存在全局的buf变量中
+     * 读lda + offset
+     * 当offset = 0时读的是gpt信息
+     */
+    send_cbw(RKFT_CMD_READLBA, 0, 2, flag);
+    recv_buf(1024);
+    recv_csw();
+
+    /* 检查返回的数据长度,超过设定范围报异常 */
+    size = GET32LE(buf + 4);
+    if (size > MAX_PARAM_LENGTH)
+        fatal("Bad data length!\n");
+    if (size + 12 > 1024) {
+        send_cbw(RKFT_CMD_READLBA, 0, (size + 12 + 511) >> 9, flag);
+        recv_buf((size + 12 + 511) & ~511);
+        recv_csw();
+    }
+
+    memcpy(parameters, buf + 8, size);
+    parameters[size] = '\0';
+    return parameters;
+}
+
+/*
+ * Load the partition table of the device: from memory or the cache if
+ * the parameter block (or GPT header) is unchanged, else by parsing it.
+ */
+static int partitions_load(uint8_t flag)
+{
+    char key[sizeof(partition_key)];
+    uint32_t size, crc;
+    int gpt;
+
+    /* Only read the sectors with the identifying CRC */
+    send_cbw(RKFT_CMD_READLBA, 0, 2, flag);
+    recv_buf(1024);
+    recv_csw();
+    if ((gpt = !memcmp(buf + 512, GPT_HEADER_SIGNATURE, 8))) {
+        crc = GET32LE(buf + 512 + 16);
+    } else if (!memcmp(buf, "PARM", 4)) {
+        size = GET32LE(buf + 4);
+        if (size > MAX_PARAM_LENGTH)
+            fatal("Bad data length!\n");
+        if (size + 12 > 1024) {
+            send_cbw(RKFT_CMD_READLBA, (size + 8) >> 9, 2, flag);
+            recv_buf(1024);
+            recv_csw();
+            crc = GET32LE(buf + ((size + 8) & 511));
+        } else
+            crc = GET32LE(buf + 8 + size);
+    } else {
+        info("Error: no parameter block or GPT found.\n");
+        return -1;
+    }
+
+    strcpy(key, partition_key);
+    partition_key_set(crc);
+    if (partition_count >= 0 && !strcmp(key, partition_key))
+        return 0;
+    if (!partition_cache_lookup(partition_key)) {
+        info("using cached partition table\n");
+        partitions_resolve(flag);
+        return 0;
+    }
+
+    if (gpt) {
+        if (gpt_parse(buf + 512, flag))
+            goto bad;
+    } else {
+        read_parameters(flag);
+        if (mtdparts_parse(parameters, flag))
+            goto bad;
+    }
+    partition_cache_store(partition_key);
+    return 0;
+bad:
+    partition_count = -1;
+    return -1;
+}
+
+static const struct partition *partition_find(const char *name)
+{
+    int i;
+
+    for (i = 0; i < partition_count; i++)
+        if (!strcmp(partitions[i].name, name))
+            return &partitions[i];
+    return NULL;
+}
+
+/*
+ * update.img
+ *
+ * An RKAF image (or an RKFW image with one embedded) is flashed in one
+ * session, straight from the mapped file.  The file table starts at 0x8c
+ * with 0x70 byte entries, as decoded by rkunpack:
+ *
+ *   0x00 name, 0x20 path, 0x60 image offset, 0x64 flash offset,
+ *   0x68 image size, 0x6c file size
+ *
+ * The parameter entry is written first and its mtdparts decides where
+ * the other entries go, by their name.  Entries without a partition
+ * (the bootloader, package-file, scripts) are skipped.  Every entry is
+ * checked to fit before anything is written.
+ */
+static void flash_update(uint8_t flag)
+{
+    uint8_t *img, *rkaf, *p, *param = NULL;
+    uint64_t len;
+    uint32_t i, count, ioff, fsize, param_len = 0, *offsets;
+    int *sizes, pass;
+    const struct partition *part;
+
+    input_open();
+    if (!input_data)
+        fatal("update image must be a regular file\n");
+    img = input_data;
+    len = input_size;
+
+    rkaf = img;
+    if (len >= 0x29 && !memcmp(img, "RKFW", 4)) {
+        ioff = GET32LE(img + 0x21);
+        if ((uint64_t)ioff + GET32LE(img + 0x25) > len)
+            fatal("embedded update.img out of range\n");
+        rkaf = img + ioff;
+        len  = GET32LE(img + 0x25);
+        info("RKFW image, using the embedded update.img\n");
+    }
+    if (len < 0x8c || memcmp(rkaf, "RKAF", 4))
+        fatal("not an RKAF update image\n");
+    count = GET32LE(rkaf + 0x88);
+    if (0x8c + (uint64_t)count * 0x70 > len)
+        fatal("bad file table\n");
+
+    offsets = malloc(count * sizeof(*offsets) + 1);
+    sizes   = malloc(count * sizeof(*sizes) + 1);
+    if (!offsets || !sizes)
+        fatal("out of memory\n");
+
+    info("manufacturer: %.56s\n", rkaf + 0x48);
+    info("model: %.64s\n", rkaf + 0x08);
+
+    for (i = 0, p = rkaf + 0x8c; i < count; i++, p += 0x70) {
+        ioff  = GET32LE(p + 0x60);
+        fsize = GET32LE(p + 0x6c);
+        if ((uint64_t)ioff + fsize > len)
+            fatal("%.32s: out of range\n", p);
+        if (!memcmp(p, "parameter", 9)) {
+            if (fsize < 12 || memcmp(rkaf + ioff, "PARM", 4))
+                fatal("bad parameter entry\n");
+            param = rkaf + ioff + 8;
+            param_len = fsize - 12;
+        }
+    }
+
+    if (param) {
+        if (param_len > MAX_PARAM_LENGTH)
+            fatal("parameter file too large\n");
+        memcpy(parameters, param, param_len);
+        parameters[param_len] = '\0';
+        if (mtdparts_parse(parameters, flag))
+            fatal("bad parameter entry\n");
+        partition_key_set(rkcrc32(0, param, param_len));
+    } else {
+        info("no parameter entry, using the parameters on the device\n");
+        if (partitions_load(flag))
+            fatal("no partition table\n");
+    }
+
+    /* check everything first, then write */
+    for (pass = 0; pass < 2; pass++) {
+        if (pass && param) {
+            info("writing parameter\n");
+            write_parameters(param, param_len, flag);
+            fprintf(stderr, "... Done!\n");
+            partition_cache_store(partition_key);
+        }
+        for (i = 0, p = rkaf + 0x8c; i < count; i++, p += 0x70) {
+            char name[33];
+
+            memcpy(name, p, 32);
+            name[32] = '\0';
+            ioff  = GET32LE(p + 0x60);
+            fsize = GET32LE(p + 0x6c);
+
+            if (!pass) {
+                sizes[i] = -1;
+                if (!strcmp(name, "parameter") || !memcmp(p + 0x20, "SELF", 4))
+                    continue;
+                if (!strcmp(name, "bootloader")) {
+                    info("skipping bootloader\n");
+                    continue;
+                }
+                if (!(part = partition_find(name))) {
+                    info("skipping %s, no such partition\n", name);
+                    continue;
+                }
+                offsets[i] = part->offset;
+                sizes[i]   = part->size;
+                if ((uint64_t)fsize > (uint64_t)sizes[i] << 9)
+                    fatal("%s is %u bytes, but the partition holds only %llu\n",
+                          name, fsize, (unsigned long long)sizes[i] << 9);
+                continue;
+            }
+            if (sizes[i] < 0)
+                continue;
+
+            info("writing %s (%u bytes) at offset 0x%08x\n", name, fsize, offsets[i]);
+            input_data = rkaf + ioff;
+            input_size = fsize;
+            input_pos = input_peeked = 0;
+            write_flash(offsets[i], sizes[i], flag);
+        }
+    }
+    free(offsets);
+    free(sizes);
+    input_close();
+}
+
+/*
+ * Erase
+ *
+ * Whole erase blocks are erased with EraseSectors, which moves no data
+ * over USB.  Unaligned head and tail ranges, and everything after a
+ * failed EraseSectors, are erased by writing 0xff.
+ */
+#define RKFT_ERASE_MAX      0xffff      /* sectors per EraseSectors */
+
+static void erase_by_writing(uint32_t offset, int size, uint8_t flag)
+{
+    int nsectors;
+
+    memset(buf, 0xff, blocksize);
+    while (size > 0) {
+        nsectors = size < blocksize >> 9 ? size : blocksize >> 9;
+        infocr("erasing flash memory at offset 0x%08x", offset);
+
+        send_cbw(RKFT_CMD_WRITELBA, offset, nsectors, flag);
+        send_buf(nsectors << 9);
+        recv_csw();
+
+        offset += nsectors;
+        size   -= nsectors;
+    }
+}
+
+static void erase_flash(uint32_t offset, int size, uint8_t flag)
+{
+    nand_info *nand = (nand_info *) buf;
+    uint32_t erase_block, head, max, nsectors;
+
+    send_cbw(RKFT_CMD_READFLASHINFO, 0, 0, flag);
+    recv_buf(512);
+    recv_csw();
+
+    erase_block = nand->block_size;
+    if (!erase_block || erase_block > RKFT_ERASE_MAX) {
+        erase_by_writing(offset, size, flag);
+        return;
+    }
+
+    head = (erase_block - offset % erase_block) % erase_block;
+    if ((int)head >= size) {
+        erase_by_writing(offset, size, flag);
+        return;
+    }
+    erase_by_writing(offset, head, flag);
+    offset += head;
+    size   -= head;
+
+    max = RKFT_ERASE_MAX - RKFT_ERASE_MAX % erase_block;
+    while ((uint32_t)size >= erase_block) {
+        nsectors = size - size % erase_block;
+        if (nsectors > max)
+            nsectors = max;
+        infocr("erasing flash memory at offset 0x%08x", offset);
+
+        send_cbw(RKFT_CMD_ERASESECTORS, offset, nsectors, flag);
+        recv_csw();
+        if (memcmp(csw, "USBS", 4) || csw[12]) {
+            fprintf(stderr, "\n");
+            info("EraseSectors failed, falling back to writing 0xff\n");
+            break;
+        }
+
+        offset += nsectors;
+        size   -= nsectors;
+    }
+    erase_by_writing(offset, size, flag);
+}
+
+/*
+ * IDB write
+ *
+ * IDB sectors are 528 bytes: 512 bytes of data and a spare area, which
+ * is left 0xff.  Up to RKFT_IDB_INCR of them go in one WriteSector
+ * command, like i reads them.  With --idb-copies n every batch is also
+ * written n-1 more times, one NAND erase block apart, so the redundant
+ * copies of the IDBlock are written from a single pass over the input.
+ * Returns the number of sectors written per copy.
+ */
+static int idb_copies = 1;
+
+static int write_idb(uint32_t offset, int size, uint8_t flag)
+{
+    nand_info *nand = (nand_info *) buf;
+    uint32_t stride = 0;
+    int i, n, got, done = 0;
+
+    if (idb_copies > 1) {
+        send_cbw(RKFT_CMD_READFLASHINFO, 0, 0, flag);
+        recv_buf(512);
+        recv_csw();
+        if (!(stride = nand->block_size))
+            fatal("cannot get the NAND block size for --idb-copies\n");
+        if ((uint32_t)size > stride)
+            fatal("IDB (%d sectors) does not fit in a NAND block (%u sectors)\n",
+                  size, stride);
+    }
+
+    while (size > 0) {
+        n = size > RKFT_IDB_INCR ? RKFT_IDB_INCR : size;
+
+        memset(buf, 0xff, n * RKFT_IDB_BLOCKSIZE);
+        for (i = 0; i < n; i++) {
+            got = read_full(STDIN_FILENO, buf + i * RKFT_IDB_BLOCKSIZE,
+                            RKFT_IDB_DATASIZE);
+            if (got < RKFT_IDB_DATASIZE) {
+                if (got > 0)
+                    i++;
+                break;
+            }
+        }
+        if (!(n = i))
+            break;
+
+        for (i = 0; i < idb_copies; i++) {
+            infocr("writing IDB flash memory at offset 0x%08x",
+                   offset + i * stride);
+            send_cbw(RKFT_CMD_WRITESECTOR, offset + i * stride, n, flag);
+            send_buf(n * RKFT_IDB_BLOCKSIZE);
+            check_csw("WriteSector", offset + i * stride);
+        }
+
+        offset += n;
+        size   -= n;
+        done   += n;
+        if (got < RKFT_IDB_DATASIZE)
+            break;
+    }
+    return done;
+}
+
+/*
+ * Benchmark
+ *
+ * Measures flash and SDRAM throughput for a matrix of transfer sizes and
+ * queue depths and prints the results as JSON.  The flash range given on
+ * the command line is overwritten.  SDRAM is exercised in a window above
+ * where a kernel would be loaded.
+ */
+#define RKFT_BENCH_SDRAM        0x01000000  /* offset from SDRAM_BASE_ADDRESS */
+#define RKFT_BENCH_SDRAM_WINDOW 0x00100000
+#define RKFT_BENCH_SDRAM_BYTES  0x00400000  /* per measurement */
+#define RKFT_BENCH_MAX_QUEUE    16
+
+static const int bench_sizes[] = { 0x4000, 0x10000, 0x40000, 0x100000 };
+static const int bench_sdram_sizes[] = { 0x1000, 0x4000, 0x8000 };
+
+static double *bench_latency;
+static int bench_count;
+
+static double cpu_time(void)
+{
+#ifndef _WIN32
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static void bench_done(struct aio_slot *s)
+{
+    bench_latency[bench_count++] = s->completed - s->submitted;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(int p)
+{
+    return bench_latency[(bench_count - 1) * p / 100] * 1e6;
+}
+
+/*
+ * One measurement: move bytes in commands of size bytes with depth
+ * commands in flight, starting at offset and wrapping at offset + window
+ * (sectors for flash, bytes for SDRAM).
+ */
+static void bench_run(int *first, const char *op, uint32_t command,
+                      uint32_t offset, uint32_t window, int size, int depth,
+                      uint64_t bytes)
+{
+    int flash = command == RKFT_CMD_READLBA || command == RKFT_CMD_WRITELBA;
+    int unit = flash ? size >> 9 : size;
+    uint32_t pos = 0;
+    uint64_t done;
+    double start, cpu;
+    int i, j, commands = bytes / size;
+    struct aio_slot *s;
+
+    infocr("%-5s %s, %7d bytes, queue depth %2d", op, flash ? "flash" : "sdram",
+           size, depth);
+
+    queue_depth = depth;
+    aio_init(size);
+    for (i = 0; i < depth; i++)
+        for (j = 0; j < size; j++)
+            aio[i].buffer[j] = j * 7 + i;
+    if (!(bench_latency = malloc(commands * sizeof(double))))
+        fatal("out of memory\n");
+    bench_count = 0;
+
+    cpu = cpu_time();
+    start = now();
+    for (done = 0; done + size <= bytes; done += size) {
+        if (pos + unit > window)
+            pos = 0;
+        s = aio_get();
+        aio_submit(s, command, offset + pos, unit, size, bench_done);
+        pos += unit;
+    }
+    aio_flush();
+    start = now() - start;
+    cpu = cpu_time() - cpu;
+    aio_free();
+
+    qsort(bench_latency, bench_count, sizeof(double), cmp_double);
+    printf("%s    {\"op\": \"%s\", \"target\": \"%s\", \"size\": %d, "
+           "\"queue\": %d, \"commands\": %d, \"bytes\": %llu, "
+           "\"seconds\": %.6f, \"mbps\": %.3f, "
+           "\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f}, "
+           "\"cpu_seconds\": %.6f}",
+           *first ? "" : ",\n", op, flash ? "flash" : "sdram", size, depth,
+           bench_count, (unsigned long long)done, start,
+           start > 0 ? done / start / 1e6 : 0, percentile(50), percentile(99),
+           percentile(100), cpu);
+    fflush(stdout);
+    *first = 0;
+    free(bench_latency);
+}
+
+static void bench(const char *name, uint32_t offset, uint32_t size)
+{
+    int max_depth = queue_depth > 1 ? queue_depth : RKFT_BENCH_MAX_QUEUE;
+    int first = 1, depth;
+    unsigned int i;
+    char chip[24];
+
+    /* Same layout as the v command, to tell loader versions apart */
+    memset(buf, 0, 16);
+    send_cbw(RKFT_CMD_READCHIPINFO, 0, 0, 0);
+    recv_buf(16);
+    recv_csw();
+    for (i = 0; i < 16; i++)
+        if (buf[i] < 0x20 || buf[i] > 0x7e || buf[i] == '"' || buf[i] == '\\')
+            buf[i] = '?';
+    snprintf(chip, sizeof(chip), "%c%c%c%c-%c%c%c%c.%c%c.%c%c-%c%c%c%c",
+             buf[3], buf[2], buf[1], buf[0], buf[7], buf[6], buf[5], buf[4],
+             buf[11], buf[10], buf[9], buf[8], buf[15], buf[14], buf[13], buf[12]);
+
+    printf("{\n  \"device\": \"%s\",\n  \"transport\": \"%s\",\n"
+           "  \"chip\": \"%s\",\n"
+           "  \"offset\": %u,\n  \"nsectors\": %u,\n  \"results\": [\n",
+           name, tp == &usb_transport ? "usb" : "emulator", chip, offset, size);
+
+    for (i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+        uint64_t bytes = (uint64_t)size << 9;
+
+        if ((uint32_t)bench_sizes[i] > bytes)
+            break;
+        for (depth = 1; depth <= max_depth; depth <<= 1) {
+            bench_run(&first, "write", RKFT_CMD_WRITELBA, offset, size,
+                      bench_sizes[i], depth, bytes);
+            bench_run(&first, "read", RKFT_CMD_READLBA, offset, size,
+                      bench_sizes[i], depth, bytes);
+        }
+    }
+
+    for (i = 0; i < sizeof(bench_sdram_sizes) / sizeof(bench_sdram_sizes[0]); i++)
+        for (depth = 1; depth <= max_depth; depth <<= 1) {
+            bench_run(&first, "write", RKFT_CMD_WRITESDRAM, RKFT_BENCH_SDRAM,
+                      RKFT_BENCH_SDRAM_WINDOW, bench_sdram_sizes[i], depth,
+                      RKFT_BENCH_SDRAM_BYTES);
+            bench_run(&first, "read", RKFT_CMD_READSDRAM, RKFT_BENCH_SDRAM,
+                      RKFT_BENCH_SDRAM_WINDOW, bench_sdram_sizes[i], depth,
+                      RKFT_BENCH_SDRAM_BYTES);
+        }
+
+    printf("\n  ]\n}\n");
+    fprintf(stderr, "... Done!\n");
+}
+
+/* Returns the pidtab entry of a Rockchip device, or NULL */
+static const struct t_pid *rockchip_device(libusb_device *dev)
+{
+    struct libusb_device_descriptor desc;
+    const struct t_pid *ppid;
+
+    if (libusb_get_device_descriptor(dev, &desc) || desc.idVendor != 0x2207)
+        return NULL;
+    for (ppid = pidtab; ppid->pid; ppid++)
+        if (ppid->pid == desc.idProduct)
+            return ppid;
+    return NULL;
+}
+
+/* Physical location of a device, e.g. "1-2.3" */
+static void device_path(libusb_device *dev, char *path, int length)
+{
+    uint8_t ports[8];
+    int i, n, k;
+
+    n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    k = snprintf(path, length, "%d", libusb_get_bus_number(dev));
+    for (i = 0; i < n && k < length; i++)
+        k += snprintf(path + k, length - k, "%c%d", i ? '.' : '-', ports[i]);
+}
+
+/*
+ * Flash-farm mode
+ *
+ * Enumerate all Rockchip devices once and fork a worker per device that
+ * runs the job on the device at its bus/port path.  The parent draws a
+ * status line per device until all workers have exited and then prints
+ * a summary.  Returns in the workers, with farm_index set.
+ */
+#ifndef _WIN32
+static void farm_draw(int redraw)
+{
+    struct farm_slot *f;
+    double t;
+    int i;
+
+    if (!isatty(STDERR_FILENO))
+        return;
+    if (redraw)
+        fprintf(stderr, "\033[%dA", farm_count);
+    for (i = 0; i < farm_count; i++) {
+        f = &farm[i];
+        t = (f->done ? f->end : now()) - f->start;
+        fprintf(stderr, "\033[K%-16s %6.1fs %s\n", f->path, t, f->line);
+    }
+}
+
+static void farm_run(char action, const char *input_path)
+{
+    libusb_device **list;
+    struct stat st;
+    off_t input_offset = 0;
+    int i, n, fd, status, failed = 0;
+    pid_t pid;
+
+    if (strchr("rpmiXT", action))
+        fatal("--all cannot be used with actions that write to stdout\n");
+    if (strchr("wMjPlLU", action)) {
+        /*
+         * Every worker opens the input file for itself, by path: only on
+         * Linux does opening /dev/stdin give a new file offset, elsewhere
+         * it is a dup and the workers would share one.
+         */
+        if (fstat(STDIN_FILENO, &st) || !S_ISREG(st.st_mode))
+            fatal("--all needs stdin redirected from a regular file\n");
+        input_offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+#ifndef __linux__
+        if (!input_path)
+            fatal("--all needs --input on this platform\n");
+#else
+        if (!input_path)
+            input_path = "/dev/stdin";
+#endif
+    } else
+        input_path = NULL;
+
+    if (libusb_init(&c))
+        fatal("cannot init libusb\n");
+    if ((n = libusb_get_device_list(c, &list)) < 0)
+        fatal("cannot get device list\n");
+    farm = mmap(NULL, (n ? n : 1) * sizeof(*farm), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (farm == MAP_FAILED)
+        fatal("cannot allocate shared memory\n");
+    for (i = 0; i < n; i++)
+        if (rockchip_device(list[i]))
+            device_path(list[i], farm[farm_count++].path, sizeof(farm->path));
+    libusb_free_device_list(list, 1);
+    libusb_exit(c);
+
+    if (!farm_count)
+        fatal("no devices found\n");
+    info("starting on %d devices\n", farm_count);
+
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 0; i < farm_count; i++) {
+        farm[i].start = now();
+        strcpy(farm[i].line, "starting");
+        if ((pid = fork()) == -1)
+            fatal("fork: %s\n", strerror(errno));
+        if (!pid) {
+            farm_index = i;
+            srandom(getpid());
+            if ((fd = open("/dev/null", O_WRONLY)) != -1) {
+                dup2(fd, STDOUT_FILENO);
+                dup2(fd, STDERR_FILENO);
+                close(fd);
+            }
+            if (input_path) {
+                /* a fresh open file description, with its own offset */
+                if ((fd = open(input_path, O_RDONLY | O_BINARY)) == -1 ||
+                    dup2(fd, STDIN_FILENO) == -1 ||
+                    lseek(STDIN_FILENO, input_offset, SEEK_SET) == -1)
+                    fatal("cannot reopen input: %s\n", strerror(errno));
+                close(fd);
+            }
+            return;
+        }
+        farm[i].pid = pid;
+    }
+
+    farm_draw(0);
+    for (n = farm_count; n; ) {
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+            for (i = 0; i < farm_count; i++)
+                if (farm[i].pid == pid) {
+                    farm[i].end = now();
+                    farm[i].status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+                    farm[i].done = 1;
+                    n--;
+                }
+        farm_draw(1);
+        if (n)
+            usleep(200*1000);
+    }
+
+    for (i = 0; i < farm_count; i++) {
+        if (farm[i].status)
+            failed++;
+        info("%-16s %s after %.1fs: %s\n", farm[i].path,
+             farm[i].status ? "FAILED" : "ok", farm[i].end - farm[i].start,
+             farm[i].line);
+    }
+    info("%d of %d devices succeeded\n", farm_count - failed, farm_count);
+    exit(failed ? 1 : 0);
+}
+#else
+static void farm_run(char action, const char *input_path)
+{
+    (void)action;
+    (void)input_path;
+    fatal("--all is not supported on this platform\n");
+}
+#endif
+
+/*
+ * Loader upload
+ *
+ * In MASK ROM mode the boot ROM takes code by vendor control requests
+ * 0x471 (DDR init, run in SRAM) and 0x472 (USB plug, the loader that
+ * then re-enumerates), in 4096 byte pieces followed by a CRC-CCITT.  A
+ * transfer must not end in a full piece, so data of 4095 bytes mod 4096
+ * gets a zero byte before the CRC, and after 4094 a single zero byte is
+ * sent to terminate it.
+ *
+ * --loader uploads the 0x471 and 0x472 entries of a loader container
+ * (RKxxLoader.bin, the BOOT of an RKFW image), with the delays given in
+ * it, then waits for the loader to come up and runs the command on it.
+ * The boot ROM expects the entries RC4 encrypted, 512 bytes at a time with
+ * a fixed key; containers that store them in the clear say so in the RC4
+ * flag at 0x2c, and then they are encrypted here before the upload.
+ */
+#define RKFT_LOADER_WAIT    10      /* seconds */
+
+static void rc4_sectors(uint8_t *p, uint32_t len)
+{
+    static const uint8_t key[16] = {
+        124, 78, 3, 4, 85, 5, 9, 7, 45, 44, 123, 56, 23, 13, 23, 17
+    };
+    uint8_t s[256], t;
+    uint32_t n, k;
+    int i, j;
+
+    for (; len > 0; p += n, len -= n) {
+        n = len < 512 ? len : 512;
+        for (i = 0; i < 256; i++)
+            s[i] = i;
+        for (i = j = 0; i < 256; i++) {
+            j = (j + s[i] + key[i % 16]) & 0xff;
+            t = s[i]; s[i] = s[j]; s[j] = t;
+        }
+        for (i = j = k = 0; k < n; k++) {
+            i = (i + 1) & 0xff;
+            j = (j + s[i]) & 0xff;
+            t = s[i]; s[i] = s[j]; s[j] = t;
+            p[k] ^= s[(s[i] + s[j]) & 0xff];
+        }
+    }
+}
+
+static void upload_loader(uint16_t request, const uint8_t *data, int len, int rc4)
+{
+    uint8_t *p;
+    uint16_t crc16;
+    int i, n, pending = 0;
+
+    if (!(p = calloc(len + 5, 1)))
+        fatal("out of memory\n");
+    memcpy(p, data, len);
+    if (rc4)
+        rc4_sectors(p, len);
+    switch (len % 4096) {
+    case 4095: len++;        break;
+    case 4094: pending = 1;  break;
+    }
+    crc16 = rkcrc16(0xffff, p, len);
+    p[len++] = crc16 >> 8;
+    p[len++] = crc16 & 0xff;
+
+    for (i = 0; i < len; i += n) {
+        n = len - i < 4096 ? len - i : 4096;
+        if (tp->control(LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, request, p + i, n) < 0)
+            fatal("loader upload (%#x) failed\n", request);
+    }
+    if (pending && tp->control(LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, request, p + len, 1) < 0)
+        fatal("loader upload (%#x) failed\n", request);
+    free(p);
+}
+
+/* Read all of stdin */
+static uint8_t *read_input(int fd, int *len)
+{
+    uint8_t *p = NULL;
+    int n, size = 0;
+
+    *len = 0;
+    do {
+        if (*len == size && !(p = realloc(p, size += 0x40000)))
+            fatal("out of memory\n");
+        if ((n = read_full(fd, p + *len, size - *len)) < 0)
+            fatal("read error: %s\n", strerror(errno));
+        *len += n;
+    } while (*len == size);
+    return p;
+}
+
+static void upload_boot(const char *path)
+{
+    static const uint16_t requests[2] = { 0x471, 0x472 };
+    const uint8_t *e;
+    uint8_t *img;
+    uint32_t off, size, delay;
+    char name[21];
+    int fd, len, i, j, k, count, stride;
+
+    if ((fd = open(path, O_RDONLY | O_BINARY)) == -1)
+        fatal("%s: %s\n", path, strerror(errno));
+    img = read_input(fd, &len);
+    close(fd);
+    if (len < 0x2d || (memcmp(img, "BOOT", 4) && memcmp(img, "LDR ", 4)))
+        fatal("%s: not a loader (no BOOT signature)\n", path);
+
+    /* entry tables: count (1 byte), offset (4), entry size (1) */
+    for (i = 0; i < 2; i++) {
+        count  = img[0x19 + 6 * i];
+        off    = GET32LE(img + 0x1a + 6 * i);
+        stride = img[0x1e + 6 * i];
+        if (stride < 0x39 || off + (uint64_t)count * stride > (uint64_t)len)
+            fatal("%s: invalid entry table\n", path);
+
+        for (j = 0; j < count; j++) {
+            e = img + off + j * stride;
+            for (k = 0; k < 20; k++)    /* UTF-16 */
+                name[k] = e[5 + 2 * k] < 0x80 ? e[5 + 2 * k] : '?';
+            name[20] = '\0';
+            size  = GET32LE(e + 0x31);
+            delay = GET32LE(e + 0x35);
+            if ((uint64_t)GET32LE(e + 0x2d) + size > (uint64_t)len)
+                fatal("%s: %s: beyond the end of the file\n", path, name);
+
+            info("loading %s (%#x, %u bytes)\n", name, requests[i], size);
+            upload_loader(requests[i], img + GET32LE(e + 0x2d), size, img[0x2c]);
+            usleep(delay * 1000);
+        }
+    }
+    free(img);
+}
+
+/* Open the device at path, or the first Rockchip device if path is NULL */
+static const struct t_pid *open_device(const char *path)
+{
+    libusb_device **list;
+    const struct t_pid *ppid = NULL;
+    char p[32];
+    int i, n;
+
+    if ((n = libusb_get_device_list(c, &list)) < 0)
+        fatal("cannot get device list\n");
+    for (i = 0; i < n && !h; i++) {
+        if (!(ppid = rockchip_device(list[i])))
+            continue;
+        device_path(list[i], p, sizeof(p));
+        if (path && strcmp(path, p))
+            continue;
+        if (libusb_open(list[i], &h))
+            h = NULL;
+        else
+            snprintf(device_location, sizeof(device_location), "usb:%s", p);
+    }
+    libusb_free_device_list(list, 1);
+
+    return h ? ppid : NULL;
+}
 
-	/* set flag for reboot mode */
-	if (flag)
-		cbw[16] = flag;
 
-	/* dump cbw */
-	printf("\nDidrection = 0x%x\n", cbw[12]);
-	printf("Length = 0x%x\n", cbw[14]);
-	printf("CDB[0] = 0x%x\n", cbw[15]);
-	printf("CDB[1] = 0x%x\n", cbw[16]);
+/*
+ * Waiting for a device
+ *
+ * With --wait, a device that is not there yet is waited for with a
+ * libusb hotplug callback on the Rockchip vendor ID, so the job starts
+ * as soon as the board enumerates, e.g. after b or a loader upload.
+ * The callback is registered before the bus is scanned so an arrival in
+ * between is not missed.  An arrived device that cannot be opened yet
+ * (udev may still be setting it up), or a libusb without hotplug
+ * support, is retried every RKFT_WAIT_POLL ms.
+ */
+#define RKFT_WAIT_POLL      50
 
-	/* 通过usb传输将cbw发送到对端 */
-    libusb_bulk_transfer(h, EP1_WRITE, cbw, sizeof(cbw), &tmp, 0);
+static double wait_timeout;
+static int hotplug_arrived;
+
+static int LIBUSB_CALL hotplug_callback(libusb_context *ctx, libusb_device *dev,
+                                        libusb_hotplug_event event, void *user)
+{
+    (void)ctx; (void)event; (void)user;
+    if (rockchip_device(dev))
+        hotplug_arrived = 1;
+    return 0;
 }
 
-static void send_buf(int length)
+static const struct t_pid *wait_device(const char *path)
 {
-    libusb_bulk_transfer(h, EP1_WRITE, buf, length, &tmp, 0);
+    libusb_hotplug_callback_handle handle;
+    const struct t_pid *ppid;
+    struct timeval tv;
+    double t, deadline = now() + wait_timeout;
+    int hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG);
+
+    hotplug_arrived = 0;
+    if (hotplug && libusb_hotplug_register_callback(c, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+                                                    0, 0x2207, LIBUSB_HOTPLUG_MATCH_ANY,
+                                                    LIBUSB_HOTPLUG_MATCH_ANY,
+                                                    hotplug_callback, NULL, &handle))
+        hotplug = 0;
+
+    if (!(ppid = open_device(path)) && wait_timeout > 0)
+        info("waiting up to %.0fs for a device...\n", wait_timeout);
+    while (!ppid && (t = deadline - now()) > 0) {
+        if (!hotplug || hotplug_arrived) {
+            usleep(t * 1e6 < RKFT_WAIT_POLL * 1000 ? t * 1e6 : RKFT_WAIT_POLL * 1000);
+        } else {
+            tv.tv_sec  = t;
+            tv.tv_usec = (t - tv.tv_sec) * 1e6;
+            libusb_handle_events_timeout_completed(c, &tv, &hotplug_arrived);
+            if (!hotplug_arrived)
+                continue;
+        }
+        ppid = open_device(path);
+    }
+
+    if (hotplug)
+        libusb_hotplug_deregister_callback(c, handle);
+    return ppid;
 }
 
-/* 接收USB返回的结果 */
-static void recv_csw(void)
+/* Claim the opened device and get its descriptor */
+static void claim_device(struct libusb_device_descriptor *desc)
 {
-    libusb_bulk_transfer(h, EP1_READ, csw, sizeof(csw), &tmp, 0);
+    if (libusb_kernel_driver_active(h, 0) == 1) {
+        info("kernel driver active\n");
+        if (!libusb_detach_kernel_driver(h, 0))
+            info("driver detached\n");
+    }
+
+	/* claim interface */
+    if (libusb_claim_interface(h, 0) < 0)
+        fatal("cannot claim interface\n");
+    info("interface claimed\n");
+
+	/* get device descriptor */
+    if (libusb_get_device_descriptor(libusb_get_device(h), desc) != 0)
+        fatal("cannot get device descriptor\n");
 }
 
-static void recv_buf(int length)
+/*
+ * After a loader upload the device drops off the bus and comes back on
+ * the same port running the loader.  Until it has, the MASK ROM device
+ * may still be found, so it is reopened until it is no longer that.
+ */
+static const struct t_pid *reconnect(struct libusb_device_descriptor *desc)
 {
-    libusb_bulk_transfer(h, EP1_READ, buf, length, &tmp, 0);
+    const struct t_pid *ppid = NULL;
+    double deadline = now() + (wait_timeout > 0 ? wait_timeout : RKFT_LOADER_WAIT);
+    char path[sizeof(device_location)];
+
+    snprintf(path, sizeof(path), "%s", device_location + 4);    /* usb: */
+    for (;;) {
+        libusb_release_interface(h, 0);
+        libusb_close(h);
+        h = NULL;
+        usleep(RKFT_WAIT_POLL * 1000);
+
+        if ((wait_timeout = deadline - now()) <= 0 || !(ppid = wait_device(path)))
+            fatal("device did not come back after loading\n");
+        claim_device(desc);
+        if (desc->bcdUSB != 0x200)
+            return ppid;
+    }
 }
 
+/*
+ * Command line
+ */
+struct command {
+    char action;
+    uint8_t flag;
+    int offset, size;
+    char *partname, *emulate, *trace_path, *input_path, *socket, *loader;
+};
+
 #define FOCUS_ON_NEXT_ARGV do { argc--;argv++; } while(0)
 
-int main(int argc, char **argv)
+/* Parse options, action and arguments into cmd and the option globals */
+static void parse_command(int argc, char **argv, struct command *cmd)
 {
-    struct libusb_device_descriptor desc;
-    const struct t_pid *ppid = pidtab;
-    ssize_t nr;
-    int offset = 0, size = 0;
-    uint16_t crc16;
-    uint8_t flag = 0;
     char action;
-    char *partname = NULL;
 
-    info("rkflashtool v%d.%d\n", RKFLASHTOOL_VERSION_MAJOR, RKFLASHTOOL_VERSION_MINOR);
+    memset(cmd, 0, sizeof(*cmd));
 
-    FOCUS_ON_NEXT_ARGV;
+    /* Options */
+    while (argc && !strncmp(argv[0], "--", 2)) {
+        if (!strcmp(argv[0], "--queue") && argc > 1) {
+            queue_depth = strtoul(argv[1], NULL, 0);
+            if (queue_depth < 1 || queue_depth > RKFT_MAX_QUEUE)
+                fatal("queue depth must be between 1 and %d\n", RKFT_MAX_QUEUE);
+            FOCUS_ON_NEXT_ARGV;
+        } else if (!strcmp(argv[0], "--blocksize") && argc > 1) {
+            if (!strcmp(argv[1], "auto"))
+                blocksize = 0;
+            else {
+                blocksize = strtoul(argv[1], NULL, 0);
+                if (blocksize < 512 || blocksize > RKFT_MAX_BLOCKSIZE || blocksize & 511)
+                    fatal("block size must be a multiple of 512 up to %#x\n",
+                          RKFT_MAX_BLOCKSIZE);
+            }
+            FOCUS_ON_NEXT_ARGV;
+        } else if (!strcmp(argv[0], "--manifest") && argc > 1) {
+            manifest_path = argv[1];
+            FOCUS_ON_NEXT_ARGV;
+        } else if (!strcmp(argv[0], "--readback")) {
+            manifest_readback = 1;
+        } else if (!strcmp(argv[0], "--sparse")) {
+            sparse_out = 1;
+        } else if (!strcmp(argv[0], "--verify")) {
+            verify = 1;
+        } else if (!strcmp(argv[0], "--trace") && argc > 1) {
+            cmd->trace_path = argv[1];
+            FOCUS_ON_NEXT_ARGV;
+        } else if (!strcmp(argv[0], "--stats")) {
+            trace_stats = 1;
+        } else if (!strcmp(argv[0], "--input") && argc > 1) {
+            cmd->input_path = argv[1];
+            FOCUS_ON_NEXT_ARGV;
+        } else if (!strcmp(argv[0], "--output") && argc > 1) {
+            output_path = argv[1];
+            FOCUS_ON_NEXT_ARGV;
+        } else if (!strcmp(argv[0], "--journal") && argc > 1) {
+            journal_path = argv[1];
+            FOCUS_ON_NEXT_ARGV;
+        } else if (!strcmp(argv[0], "--resume")) {
+            journal_resume = 1;
+        } else if (!strcmp(argv[0], "--all")) {
+            farm_mode = 1;
+        } else if (!strcmp(argv[0], "--emulate") && argc > 1) {
+            cmd->emulate = argv[1];
+            FOCUS_ON_NEXT_ARGV;
+        } else if (!strcmp(argv[0], "--idb-copies") && argc > 1) {
+            idb_copies = strtoul(argv[1], NULL, 0);
+            if (idb_copies < 1 || idb_copies > 16)
+                fatal("--idb-copies must be 1 to 16\n");
+            FOCUS_ON_NEXT_ARGV;
+        } else if (!strcmp(argv[0], "--wait") && argc > 1) {
+            wait_timeout = strtod(argv[1], NULL);
+            FOCUS_ON_NEXT_ARGV;
+        } else if (!strcmp(argv[0], "--loader") && argc > 1) {
+            cmd->loader = argv[1];
+            FOCUS_ON_NEXT_ARGV;
+        } else if (!strcmp(argv[0], "--socket") && argc > 1) {
+            cmd->socket = argv[1];
+            FOCUS_ON_NEXT_ARGV;
+        } else
+            usage();
+        FOCUS_ON_NEXT_ARGV;
+    }
 
 	if (!argc)
 		usage();
 
-    action = **argv;
+    /* "bench", "list" and "daemon" are the only actions that are spelled out */
+    if (!strcmp(argv[0], "bench"))
+        action = 'X';
+    else if (!strcmp(argv[0], "list"))
+        action = 'T';
+    else if (!strcmp(argv[0], "daemon"))
+        action = 'D';
+    else
+        action = **argv;
 
-	FOCUS_ON_NEXT_ARGV;
+    FOCUS_ON_NEXT_ARGV;
 
+    cmd->action = action;
     switch(action) {
     case 'b':
         if (argc > 1)
 			usage();
         else if (argc == 1)
-            flag = strtoul(argv[0], NULL, 0);
+            cmd->flag = strtoul(argv[0], NULL, 0);
         break;
     case 'l':
     case 'L':
@@ -347,10 +3686,10 @@ int main(int argc, char **argv)
         if (argc < 1 || argc > 2)
 			usage();
         if (argc == 1) {
-            partname = argv[0];
+            cmd->partname = argv[0];
         } else {
-            offset = strtoul(argv[0], NULL, 0);
-            size   = strtoul(argv[1], NULL, 0);
+            cmd->offset = strtoul(argv[0], NULL, 0);
+            cmd->size   = strtoul(argv[1], NULL, 0);
         }
         break;
     case 'm':
@@ -358,194 +3697,113 @@ int main(int argc, char **argv)
     case 'B':
     case 'i':
     case 'j':
+    case 'X':
         if (argc != 2)
 			usage();
-        offset = strtoul(argv[0], NULL, 0);
-        size   = strtoul(argv[1], NULL, 0);
+        cmd->offset = strtoul(argv[0], NULL, 0);
+        cmd->size   = strtoul(argv[1], NULL, 0);
         break;
     case 'n':
     case 'v':
     case 'p':
     case 'P':
+    case 'U':
+    case 'T':
         if (argc)
 			usage();
-        offset = 0;
-        size   = 1024;
+        cmd->size = 1024;
+        break;
+    case 'D':
+        if (argc != 1)
+            usage();
+        cmd->socket = argv[0];
         break;
     default:
         usage();
     }
 
-    /* Initialize libusb */
-    if (libusb_init(&c))
-		fatal("cannot init libusb\n");
+    if (journal_resume && !journal_path)
+        fatal("--resume needs --journal\n");
+    if (action == 'U' && (journal_path || manifest_path))
+        fatal("U cannot be combined with --journal or --manifest\n");
+}
 
-    libusb_set_debug(c, 3);
+/* Open the files given by --input and --output */
+static void open_files(const struct command *cmd)
+{
+    int fd;
 
-    /* Detect connected RockChip device */
-    while ( !h && ppid->pid) {
-        h = libusb_open_device_with_vid_pid(c, 0x2207, ppid->pid);
-        if (h) {
-            info("Detected %s...\n", ppid->name);
-            break;
-        }
-        ppid++;
+    if (cmd->input_path) {
+        if ((fd = open(cmd->input_path, O_RDONLY | O_BINARY)) == -1 ||
+            dup2(fd, STDIN_FILENO) == -1)
+            fatal("%s: %s\n", cmd->input_path, strerror(errno));
+        close(fd);
     }
-    if (!h)
-		fatal("cannot open device\n");
 
-    /* Connect to device */
-    if (libusb_kernel_driver_active(h, 0) == 1) {
-        info("kernel driver active\n");
-        if (!libusb_detach_kernel_driver(h, 0))
-            info("driver detached\n");
+    /* resuming appends to what is already there */
+    if (output_path) {
+        if ((fd = open(output_path, O_WRONLY | O_CREAT | O_BINARY |
+                       (journal_resume ? 0 : O_TRUNC), 0644)) == -1 ||
+            dup2(fd, STDOUT_FILENO) == -1)
+            fatal("%s: %s\n", output_path, strerror(errno));
+        close(fd);
     }
+}
 
-	/* claim interface */
-    if (libusb_claim_interface(h, 0) < 0)
-        fatal("cannot claim interface\n");
-    info("interface claimed\n");
-
-	/* get device descriptor */
-    if (libusb_get_device_descriptor(libusb_get_device(h), &desc) != 0)
-        fatal("cannot get device descriptor\n");
+/* Run the action of cmd on the connected device */
+static void run_command(const struct command *cmd, const char *name, uint16_t bcdDevice)
+{
+    int offset = cmd->offset, size = cmd->size;
+    uint64_t total;
+    double start;
+    uint8_t *ldr;
+    uint8_t flag = cmd->flag;
+    char action = cmd->action;
+    int i;
 
-	/* oops, in mask rom mode */
-    if (desc.bcdUSB == 0x200)
-        info("MASK ROM MODE\n");
+    if (cmd->trace_path || trace_stats)
+        trace_start(cmd->trace_path);
 
     switch(action) {
     case 'l':
-        info("load DDR init\n");
-        crc16 = 0xffff;
-        while ((nr = read(STDIN_FILENO, buf, 4096)) == 4096) {
-            crc16 = rkcrc16(crc16, buf, nr);
-            libusb_control_transfer(h, LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, 1137, buf, nr, 0);
-        }
-        if (nr != -1) {
-            crc16 = rkcrc16(crc16, buf, nr);
-            buf[nr++] = crc16 >> 8;
-            buf[nr++] = crc16 & 0xff;
-            libusb_control_transfer(h, LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, 1137, buf, nr, 0);
-        }
-        goto exit;
     case 'L':
-        info("load USB loader\n");
-        crc16 = 0xffff;
-        while ((nr = read(STDIN_FILENO, buf, 4096)) == 4096) {
-            crc16 = rkcrc16(crc16, buf, nr);
-            libusb_control_transfer(h, LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, 1138, buf, nr, 0);
-        }
-        if (nr != -1) {
-            crc16 = rkcrc16(crc16, buf, nr);
-            buf[nr++] = crc16 >> 8;
-            buf[nr++] = crc16 & 0xff;
-            libusb_control_transfer(h, LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, 1138, buf, nr, 0);
-        }
+        info(action == 'l' ? "load DDR init\n" : "load USB loader\n");
+        ldr = read_input(STDIN_FILENO, &i);
+        upload_loader(action == 'l' ? 0x471 : 0x472, ldr, i, 0);
+        free(ldr);
         goto exit;
     }
 
-    /* Initialize bootloader interface */
-    send_cbw(RKFT_CMD_TESTUNITREADY, 0, 0, flag);
-    recv_csw();
-    usleep(20*1000);
+    /* Initialize bootloader interface (a daemon did so once) */
+    if (daemon_client < 0) {
+        send_cbw(RKFT_CMD_TESTUNITREADY, 0, 0, flag);
+        recv_csw();
+        usleep(20*1000);
+    }
+
+    if (!blocksize && strchr("rwe", action))
+        autotune_blocksize(name, bcdDevice);
 
     /*
 	 * 如果是读,写,擦除命令
 	 * 命令行中必定会带有分区名
 	 */
-    if (partname)
-	{
-        info("working with partition: %s\n", partname);
-
-        /*
-		 * 发送读LBA命令后得到返回结果,存在全局的buf变量中
-		 * 读lda + offset
-		 * 当offset = 0时读的是gpt信息
-		 */
-        offset = 0;
-        send_cbw(RKFT_CMD_READLBA, offset, RKFT_OFF_INCR, flag);
-        recv_buf(RKFT_BLOCKSIZE);
-        recv_csw();
+    if (cmd->partname) {
+        const struct partition *part;
 
-        /* 检查返回的数据长度,超过设定范围报异常 */
-        uint32_t *p = (uint32_t*)buf+1;
-        size = *p;
-        if (size < 0 || size > MAX_PARAM_LENGTH)
-          fatal("Bad data length!\n");
-
-        /* 从返回的数据中读出分区信息内容 */
-        const char *param = (const char *)&buf[8];
-        const char *mtdparts = strstr(param, "mtdparts=");
-        if (!mtdparts) {
-            info("Error: 'mtdparts' not found in command line.\n");
+        info("working with partition: %s\n", cmd->partname);
+        if (partitions_load(flag))
             goto exit;
-        }
-		info("%s\n", mtdparts);
-
-        /* 在分区表中找到和命令行传入的分区一致的分区 */
-        char partexp[256];
-        snprintf(partexp, 256, "(%s)", partname);
-        char *par = strstr(mtdparts, partexp);
-        if (!par) {
-            info("Error: Partition '%s' not found.\n", partname);
-            goto exit;
-        }
-
-		info("%s\n", par);
-        /* Cut string by NULL-ing just before (partition_name) */
-        par[0] = '\0';
-
-        /* Search for '@' sign */
-        char *arob = strrchr(mtdparts, '@');
-        if (!arob) {
-            info("Error: Bad syntax in mtdparts.\n");
+        if (!(part = partition_find(cmd->partname))) {
+            info("Error: Partition '%s' not found.\n", cmd->partname);
             goto exit;
         }
-
-        offset = strtoul(arob+1, NULL, 0);
+        offset = part->offset;
+        size   = part->size;
         info("found offset: %#010x\n", offset);
-
-        /* Cut string by NULL-ing just before '@' sign */
-        arob[0] = '\0';
-
-        /* Search for '-' sign (if last partition) */
-        char *minus = strrchr(mtdparts, '-');
-        if (minus) {
-            /* Read size from NAND info */
-            send_cbw(RKFT_CMD_READFLASHINFO, 0, 0, flag);
-            recv_buf(512);
-            recv_csw();
-
-            nand_info *nand = (nand_info *) buf;
-            size = nand->flash_size - offset;
-
-            info("partition extends up to the end of NAND (size: 0x%08x).\n", size);
-            goto action;
-        }
-
-        /* Search for ',' sign */
-        char *comma = strrchr(mtdparts, ',');
-        if (comma) {
-            size = strtoul(comma+1, NULL, 0);
-            info("found size: %#010x\n", size);
-            goto action;
-        }
-
-        /* Search for ':' sign (if first partition) */
-        char *colon = strrchr(mtdparts, ':');
-        if (colon) {
-            size = strtoul(colon+1, NULL, 0);
-            info("found size: %#010x\n", size);
-            goto action;
-        }
-
-        /* Error: size not found! */
-        info("Error: Bad syntax for partition size.\n");
-        goto exit;
+        info("found size: %#010x\n", size);
     }
 
-action:
     /* Check and execute command */
     switch(action) {
     case 'b':   /* Reboot device */
@@ -554,51 +3812,96 @@ action:
         recv_csw();
         break;
     case 'r':   /* Read FLASH */
+        if (journal_path)
+            journal_start('r', (uint32_t *)&offset, &size);
+        start = now();
+        total = (uint64_t)size << 9;
+        if (sparse_out)
+            sparse_begin();
+        digest_start(blocksize);
+        if (queue_depth > 1) {
+            aio_init(blocksize);
+            while (size > 0) {
+                int nsectors = size < blocksize >> 9 ? size : blocksize >> 9;
+                infocr("reading mmc at offset 0x%08x", offset);
+                aio_submit(aio_get(), RKFT_CMD_READLBA, offset, nsectors,
+                           nsectors << 9, aio_write_stdout);
+                offset += nsectors;
+                size   -= nsectors;
+            }
+            aio_flush();
+            aio_free();
+            fprintf(stderr, "... Done!\n");
+            if (sparse_out)
+                sparse_end();
+            report_rate("read", total, start);
+            digest_finish();
+            journal_finish();
+            break;
+        }
         while (size > 0) {
+            int nsectors = size < blocksize >> 9 ? size : blocksize >> 9;
             infocr("reading mmc at offset 0x%08x", offset);
 
-			/* 读lba + offset, 每次传输RKFT_OFF_INCR */
-            send_cbw(RKFT_CMD_READLBA, offset, RKFT_OFF_INCR, flag);
-            recv_buf(RKFT_BLOCKSIZE);
-            recv_csw();
+			/* 读lba + offset, 每次最多传输blocksize */
+            send_cbw(RKFT_CMD_READLBA, offset, nsectors, flag);
+            recv_buf(nsectors << 9);
+            check_csw("read", offset);
 
 			/*
 			 * 将读到的内容写道标准输出里
 			 * 如果在命令行中将标准输出重定向到文件的话
 			 * 就相当与将读到的内容写入文件
 			 */
-            if (write(STDOUT_FILENO, buf, RKFT_BLOCKSIZE) <= 0)
-                fatal("Write error! Disk full?\n");
+            digest_update(buf, nsectors << 9);
+            output_block(buf, nsectors << 9);
+            journal_advance(offset, buf, nsectors << 9);
 
-            offset += RKFT_OFF_INCR;
-            size   -= RKFT_OFF_INCR;
+            offset += nsectors;
+            size   -= nsectors;
         }
         fprintf(stderr, "... Done!\n");
+        if (sparse_out)
+            sparse_end();
+        report_rate("read", total, start);
+        digest_finish();
+        journal_finish();
         break;
     case 'w':   /* Write FLASH */
-        while (size > 0) {
-            infocr("writing flash memory at offset 0x%08x", offset);
+        {
+            uint32_t end;
 
 			/*
 			 * 从标注输入读出内容
 			 * 如果在命令行中将标准输入重定向为文件的话
 			 * 即相当于将文件内容作为要传输的数据
 			 */
-            if (read(STDIN_FILENO, buf, RKFT_BLOCKSIZE) <= 0) {
-                fprintf(stderr, "... Done!\n");
+            input_open();
+            if (manifest_path && input_sparse())
+                fatal("--manifest cannot be used with a sparse image\n");
+            if (manifest_path) {
+                manifest_load(offset, size, name, bcdDevice);
+                if (!manifest_blocks && manifest_readback)
+                    manifest_read_device(size);
+            }
+            input_check_size(offset, size);
+            if (journal_path)
+                journal_start('w', (uint32_t *)&offset, &size);
+            end = write_flash(offset, size, flag);
+            if (end < (uint32_t)(offset + size))
                 info("premature end-of-file reached.\n");
-                goto exit;
+            input_close();
+            journal_finish();
+            if (manifest_path) {
+                info("%d unchanged blocks skipped\n", manifest_skipped);
+                manifest_save((end - manifest_offset + (blocksize >> 9) - 1) / (blocksize >> 9));
             }
-
-			/* 写lba + offset, 每次传输RKFT_OFF_INCR */
-            send_cbw(RKFT_CMD_WRITELBA, offset, RKFT_OFF_INCR, flag);
-            send_buf(RKFT_BLOCKSIZE);
-            recv_csw();
-
-            offset += RKFT_OFF_INCR;
-            size   -= RKFT_OFF_INCR;
+            free(manifest);     /* also when a sparse input dropped it */
+            manifest = NULL;
         }
-        fprintf(stderr, "... Done!\n");
+        break;
+    case 'U':   /* Flash update.img */
+        flash_update(flag);
         break;
     case 'p':   /* Retreive parameters */
         {
@@ -629,35 +3932,13 @@ action:
         break;
     case 'P':   /* Write parameters */
         {
-            /* Header */
-            strncpy((char *)buf, "PARM", 4);
-
             /* Content */
             int sizeRead;
-            if ((sizeRead = read(STDIN_FILENO, buf + 8, RKFT_BLOCKSIZE - 8)) < 0) {
+            if ((sizeRead = read(STDIN_FILENO, buf + 8, RKFT_BLOCKSIZE - 12)) < 0) {
                 info("read error: %s\n", strerror(errno));
                 goto exit;
             }
-
-            /* Length */
-            *(uint32_t *)(buf + 4) = sizeRead;
-
-            /* CRC */
-            uint32_t crc = 0;
-            crc = rkcrc32(crc, buf + 8, sizeRead);
-            PUT32LE(buf + 8 + sizeRead, crc);
-
-            /*
-             * The parameter file is written at 8 different offsets:
-             * 0x0000, 0x0400, 0x0800, 0x0C00, 0x1000, 0x1400, 0x1800, 0x1C00
-             */
-
-            for(offset = 0; offset < 0x2000; offset += 0x400) {
-                infocr("writing flash memory at offset 0x%08x", offset);
-                send_cbw(RKFT_CMD_WRITELBA, offset, RKFT_OFF_INCR, flag);
-                send_buf(RKFT_BLOCKSIZE);
-                recv_csw();
-            }
+            write_parameters(buf + 8, sizeRead, flag);
         }
         fprintf(stderr, "... Done!\n");
         break;
@@ -679,21 +3960,24 @@ action:
         fprintf(stderr, "... Done!\n");
         break;
     case 'M':   /* Write RAM */
+        input_open();
         while (size > 0) {
             int sizeRead;
-            if ((sizeRead = read(STDIN_FILENO, buf, RKFT_BLOCKSIZE)) <= 0) {
+            uint8_t *p = input_get(buf, size < RKFT_BLOCKSIZE ? size : RKFT_BLOCKSIZE, &sizeRead);
+            if (sizeRead <= 0) {
                 info("premature end-of-file reached.\n");
                 goto exit;
             }
             infocr("writing memory at offset 0x%08x size %x", offset, sizeRead);
 
             send_cbw(RKFT_CMD_WRITESDRAM, offset - SDRAM_BASE_ADDRESS, sizeRead, flag);
-            send_buf(sizeRead);
-            recv_csw();
+            tp->bulk(EP1_WRITE, p, sizeRead, &tmp, 0);
+            check_csw("write", offset);
 
             offset += sizeRead;
             size -= sizeRead;
         }
+        input_close();
         fprintf(stderr, "... Done!\n");
         break;
     case 'B':   /* Exec RAM */
@@ -719,38 +4003,27 @@ action:
         fprintf(stderr, "... Done!\n");
         break;
     case 'j':   /* write IDB */
-        while (size > 0) {
-            infocr("writing IDB flash memory at offset 0x%08x", offset);
-
-            memset(ibuf, RKFT_IDB_BLOCKSIZE, 0xff);
-            if (read(STDIN_FILENO, ibuf, RKFT_IDB_DATASIZE) <= 0) {
-                fprintf(stderr, "... Done!\n");
-                info("premature end-of-file reached.\n");
-                goto exit;
-            }
-
-            send_cbw(RKFT_CMD_WRITESECTOR, offset, 1, flag);
-            libusb_bulk_transfer(h, EP1_WRITE, ibuf, RKFT_IDB_BLOCKSIZE, &tmp, 0);
-            recv_csw();
-            offset += 1;
-            size -= 1;
+        if (write_idb(offset, size, flag) < size) {
+            fprintf(stderr, "... Done!\n");
+            info("premature end-of-file reached.\n");
+            goto exit;
         }
         fprintf(stderr, "... Done!\n");
         break;
     case 'e':   /* Erase flash */
-        memset(buf, 0xff, RKFT_BLOCKSIZE);
-        while (size > 0) {
-            infocr("erasing flash memory at offset 0x%08x", offset);
-
-            send_cbw(RKFT_CMD_WRITELBA, offset, RKFT_OFF_INCR, flag);
-            send_buf(RKFT_BLOCKSIZE);
-            recv_csw();
-
-            offset += RKFT_OFF_INCR;
-            size   -= RKFT_OFF_INCR;
-        }
+        erase_flash(offset, size, flag);
         fprintf(stderr, "... Done!\n");
         break;
+    case 'T':   /* List partitions */
+        if (partitions_load(flag))
+            goto exit;
+        for (i = 0; i < partition_count; i++)
+            printf("%#010x %#010x %s\n", partitions[i].offset,
+                   partitions[i].size, partitions[i].name);
+        break;
+    case 'X':   /* Benchmark */
+        bench(name, offset, size);
+        break;
     case 'v':   /* Read Chip Version */
         send_cbw(RKFT_CMD_READCHIPINFO, 0, 0, flag);
         recv_buf(16);
@@ -809,10 +4082,390 @@ action:
     }
 
 exit:
-    /* Disconnect and close all interfaces */
+    trace_stop();
+}
 
-    libusb_release_interface(h, 0);
-    libusb_close(h);
-    libusb_exit(c);
+/*
+ * Daemon mode
+ *
+ * "rkflashtool daemon socket" connects to the device once and then runs
+ * the commands of clients on it, one after the other.  A client is
+ * rkflashtool started with --socket (or $RKFLASHTOOL_SOCKET): it sends
+ * its command line, its stdin, stdout and stderr and its working
+ * directory over the Unix socket and exits with the status the daemon
+ * sends back.  The connection, interface claim and TESTUNITREADY are
+ * paid once, so a request costs little more than its protocol commands.
+ *
+ * A command that fails may leave threads, transfers or the loader in
+ * any state, so the daemon answers the client and then re-executes
+ * itself, which reconnects to the device.  The listening socket is kept
+ * open across the exec and its number passed in $RKFLASHTOOL_DAEMON_FD.
+ */
+#define DAEMON_MAX_ARGS     0x10000     /* bytes of command line */
+
+#ifndef _WIN32
+static int daemon_listen = -1, daemon_stdio[4] = { -1, -1, -1, -1 };
+
+/* Write all of len or fail */
+static int write_full(int fd, const void *data, int len)
+{
+    const uint8_t *p = data;
+    int n;
+
+    while (len > 0) {
+        if ((n = write(fd, p, len)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        p   += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Send the exit status of a request and go back to the daemon's own stdio */
+static void daemon_reply(int status)
+{
+    uint8_t reply[4];
+    int i;
+
+    fflush(stdout);
+    PUT32LE(reply, status);
+    if (write_full(daemon_client, reply, 4))
+        fprintf(stderr, "rkflashtool: info: client went away\n");
+    close(daemon_client);
+    daemon_client = -1;
+    for (i = 0; i < 3; i++)
+        dup2(daemon_stdio[i], i);
+    if (fchdir(daemon_stdio[3]))
+        fprintf(stderr, "rkflashtool: info: fchdir: %s\n", strerror(errno));
+}
+
+static void daemon_restart(int status)
+{
+    char fd[16];
+    int i;
+
+    daemon_reply(status);
+    fprintf(stderr, "rkflashtool: info: request failed, restarting\n");
+
+    /* keep nothing open but the socket */
+    for (i = 3; i < 1024; i++)
+        if (i != daemon_listen)
+            fcntl(i, F_SETFD, FD_CLOEXEC);
+    snprintf(fd, sizeof(fd), "%d", daemon_listen);
+    setenv("RKFLASHTOOL_DAEMON_FD", fd, 1);
+    execvp(daemon_argv[0], daemon_argv);
+    fprintf(stderr, "rkflashtool: fatal: %s: %s\n", daemon_argv[0], strerror(errno));
+    _exit(status);
+}
+
+/* Receive a request: command line into args, stdio and cwd into fds */
+static int daemon_receive(char *args, int fds[4])
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(4 * sizeof(int))];
+    } control;
+    uint8_t hdr[4];
+    int len, n;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = hdr;
+    iov.iov_len = 4;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(daemon_client, &msg, MSG_WAITALL) != 4 ||
+        !(cm = CMSG_FIRSTHDR(&msg)) || cm->cmsg_level != SOL_SOCKET ||
+        cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(4 * sizeof(int)))
+        return -1;
+    memcpy(fds, CMSG_DATA(cm), 4 * sizeof(int));
+
+    len = GET32LE(hdr);
+    if (len <= 0 || len > DAEMON_MAX_ARGS)
+        return -1;
+    for (n = 0; n < len; ) {
+        int r = read(daemon_client, args + n, len - n);
+        if (r <= 0)
+            return -1;
+        n += r;
+    }
+    args[len - 1] = '\0';
+    return len;
+}
+
+static void daemon_serve(const char *path, const char *name,
+                         const struct libusb_device_descriptor *desc)
+{
+    static char args[DAEMON_MAX_ARGS], *argv[DAEMON_MAX_ARGS / 2];
+    struct sockaddr_un addr;
+    struct command cmd;
+    struct stat st;
+    const char *env;
+    mode_t mask;
+    int i, fds[4], len, argc;
+
+    if ((env = getenv("RKFLASHTOOL_DAEMON_FD"))) {
+        daemon_listen = atoi(env);
+        unsetenv("RKFLASHTOOL_DAEMON_FD");
+    } else {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path))
+            fatal("%s: socket path too long\n", path);
+        strcpy(addr.sun_path, path);
+        if ((daemon_listen = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+            fatal("socket: %s\n", strerror(errno));
+        /* replace a stale socket, nothing else */
+        if (!lstat(path, &st)) {
+            if (!S_ISSOCK(st.st_mode))
+                fatal("%s: exists and is not a socket\n", path);
+            unlink(path);
+        }
+        /* only the owner may send commands: create it 0600 */
+        mask = umask(0177);
+        i = bind(daemon_listen, (struct sockaddr *)&addr, sizeof(addr));
+        umask(mask);
+        if (i || listen(daemon_listen, 16))
+            fatal("%s: %s\n", path, strerror(errno));
+    }
+    fcntl(daemon_listen, F_SETFD, 0);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (i = 0; i < 3; i++)
+        daemon_stdio[i] = dup(i);
+    if ((daemon_stdio[3] = open(".", O_RDONLY)) == -1)
+        fatal(".: %s\n", strerror(errno));
+
+    /* Initialize bootloader interface, once */
+    if (desc->bcdUSB != 0x200) {
+        send_cbw(RKFT_CMD_TESTUNITREADY, 0, 0, 0);
+        recv_csw();
+        usleep(20*1000);
+    }
+    info("serving %s on %s\n", name, path);
+
+    for (;;) {
+        if ((daemon_client = accept(daemon_listen, NULL, NULL)) == -1) {
+            if (errno == EINTR)
+                continue;
+            fatal("accept: %s\n", strerror(errno));
+        }
+        if ((len = daemon_receive(args, fds)) < 0) {
+            close(daemon_client);
+            daemon_client = -1;
+            continue;
+        }
+        for (i = 0; i < 3; i++) {
+            dup2(fds[i], i);
+            close(fds[i]);
+        }
+        i = fchdir(fds[3]);
+        close(fds[3]);
+        if (i)
+            fatal("fchdir: %s\n", strerror(errno));
+
+        for (argc = i = 0; i < len; i += strlen(args + i) + 1)
+            argv[argc++] = args + i;
+
+        /* defaults for the options */
+        queue_depth = 1;
+        blocksize = RKFT_BLOCKSIZE;
+        manifest_path = output_path = journal_path = NULL;
+        manifest_readback = manifest_skipped = journal_resume = 0;
+        sparse_out = verify = trace_stats = farm_mode = 0;
+        idb_copies = 1;
+
+        parse_command(argc, argv, &cmd);
+        if (cmd.action == 'D' || cmd.emulate || cmd.socket || cmd.loader || farm_mode)
+            fatal("daemon, --emulate, --socket, --loader and --all cannot be sent to a daemon\n");
+        open_files(&cmd);
+        run_command(&cmd, name, desc->bcdDevice);
+        daemon_reply(0);
+    }
+}
+
+/*
+ * Run the command line on the daemon at path and exit with its status.
+ * Returns if there is no daemon and must is not set.
+ */
+static void daemon_request(const char *path, int argc, char **argv, int must)
+{
+    static char args[DAEMON_MAX_ARGS];
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(4 * sizeof(int))];
+    } control;
+    uint8_t hdr[4];
+    int fd, fds[4], len = 0, n;
+
+    /* the command line without --socket */
+    for (; argc; argc--, argv++) {
+        if (!strcmp(argv[0], "--socket") && argc > 1) {
+            argc--, argv++;
+            continue;
+        }
+        n = strlen(argv[0]) + 1;
+        if (len + n > DAEMON_MAX_ARGS)
+            fatal("command line too long\n");
+        memcpy(args + len, argv[0], n);
+        len += n;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        fatal("%s: socket path too long\n", path);
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        fatal("socket: %s\n", strerror(errno));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        if (must)
+            fatal("%s: %s\n", path, strerror(errno));
+        close(fd);
+        return;
+    }
+
+    fds[0] = STDIN_FILENO;
+    fds[1] = STDOUT_FILENO;
+    fds[2] = STDERR_FILENO;
+    if ((fds[3] = open(".", O_RDONLY)) == -1)
+        fatal(".: %s\n", strerror(errno));
+
+    memset(&msg, 0, sizeof(msg));
+    PUT32LE(hdr, len);
+    iov.iov_base = hdr;
+    iov.iov_len = 4;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(4 * sizeof(int));
+    memcpy(CMSG_DATA(cm), fds, 4 * sizeof(int));
+    if (sendmsg(fd, &msg, 0) != 4 || write_full(fd, args, len))
+        fatal("%s: %s\n", path, strerror(errno));
+    close(fds[3]);
+
+    if (read_full(fd, hdr, 4) != 4)
+        fatal("%s: daemon hung up\n", path);
+    exit(GET32LE(hdr));
+}
+#else
+static void daemon_restart(int status)
+{
+    exit(status);
+}
+
+static void daemon_serve(const char *path, const char *name,
+                         const struct libusb_device_descriptor *desc)
+{
+    (void)path;
+    (void)name;
+    (void)desc;
+    fatal("daemon mode is not supported on Windows\n");
+}
+
+static void daemon_request(const char *path, int argc, char **argv, int must)
+{
+    (void)path;
+    (void)argc;
+    (void)argv;
+    if (must)
+        fatal("--socket is not supported on Windows\n");
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    struct libusb_device_descriptor desc;
+    const struct t_pid *ppid;
+    struct command cmd;
+
+    info("rkflashtool v%d.%d\n", RKFLASHTOOL_VERSION_MAJOR, RKFLASHTOOL_VERSION_MINOR);
+
+    daemon_argv = argv;
+    FOCUS_ON_NEXT_ARGV;
+    parse_command(argc, argv, &cmd);
+
+    /* Hand the command to a daemon if there is one */
+    if (cmd.action != 'D') {
+        if (cmd.socket)
+            daemon_request(cmd.socket, argc, argv, 1);
+        else if (getenv("RKFLASHTOOL_SOCKET") && !cmd.emulate && !farm_mode)
+            daemon_request(getenv("RKFLASHTOOL_SOCKET"), argc, argv, 0);
+    }
+    open_files(&cmd);
+
+    if (farm_mode) {
+        if (cmd.emulate)
+            fatal("--all cannot be combined with --emulate\n");
+        if (journal_path)
+            fatal("--all cannot be combined with --journal\n");
+        if (manifest_path)
+            fatal("--all cannot be combined with --manifest\n");
+        if (cmd.trace_path)
+            fatal("--all cannot be combined with --trace\n");
+        farm_run(cmd.action, cmd.input_path);
+    }
+
+    if (cmd.emulate) {
+        static const struct t_pid emu_pid = { 0, "EMU" };
+
+        tp = &emu_transport;
+        emu_open(cmd.emulate);
+        snprintf(device_location, sizeof(device_location), "emu:%.*s",
+                 (int)strcspn(cmd.emulate, ", \t"), cmd.emulate);
+        ppid = &emu_pid;
+        memset(&desc, 0, sizeof(desc));
+        desc.bcdUSB = 0x201;
+        goto connected;
+    }
+
+    /* Initialize libusb */
+    if (libusb_init(&c))
+		fatal("cannot init libusb\n");
+
+    libusb_set_debug(c, 3);
+
+    /* Detect connected RockChip device */
+    if (!(ppid = wait_device(farm_index >= 0 ? farm[farm_index].path : NULL)))
+		fatal("cannot open device\n");
+    info("Detected %s...\n", ppid->name);
+
+    /* Connect to device */
+    claim_device(&desc);
+
+	/* oops, in mask rom mode */
+    if (desc.bcdUSB == 0x200) {
+        info("MASK ROM MODE\n");
+        if (cmd.loader) {
+            upload_boot(cmd.loader);
+            ppid = reconnect(&desc);
+            info("Detected %s running the loader\n", ppid->name);
+        }
+    } else if (cmd.loader)
+        info("not in MASK ROM mode, %s not loaded\n", cmd.loader);
+
+connected:
+    if (cmd.action == 'D')
+        daemon_serve(cmd.socket, ppid->name, &desc);
+    else
+        run_command(&cmd, ppid->name, desc.bcdDevice);
+
+    /* Disconnect and close all interfaces */
+    tp->close();
     return 0;
 }
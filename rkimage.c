@@ -0,0 +1,265 @@
+/*-
+ * Copyright (c) 2013 Ivo van Poorten
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Partition image helpers, formerly the dd scripts rkpad, rkmisc and
+ * rkunsign (which now call this), plus sign (rkcrc -k/-p).
+ *
+ * Zeroes are never written: the output is extended with ftruncate, which
+ * leaves a hole, and holes in the input (SEEK_HOLE) are skipped when
+ * copying. Data is copied by the kernel with copy_file_range where there
+ * is one, else through a 1MB buffer.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE         /* copy_file_range */
+#endif
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rkcrc.h"
+#include "rkflashtool.h"
+#include "version.h"
+
+#ifndef _WIN32
+#define O_BINARY 0
+#endif
+
+#define BUFSIZE     0x100000
+#define MISC_SIZE   (4 << 20)
+
+static const char *const strings[2] = { "info", "fatal" };
+
+static void info_and_fatal(const int s, char *f, ...) {
+    va_list ap;
+    va_start(ap,f);
+    fprintf(stderr, "rkimage: %s: ", strings[s]);
+    vfprintf(stderr, f, ap);
+    va_end(ap);
+    if (s) exit(s);
+}
+
+#define info(...)   info_and_fatal(0, __VA_ARGS__)
+#define fatal(...)  info_and_fatal(1, __VA_ARGS__)
+
+static const char *inname, *outname;
+static uint8_t buf[BUFSIZE];
+
+static int open_in(const char *path, struct stat *st) {
+    int fd;
+
+    if ((fd = open(path, O_BINARY | O_RDONLY)) == -1 || fstat(fd, st) == -1)
+        fatal("%s: %s\n", path, strerror(errno));
+    inname = path;
+    return fd;
+}
+
+static int open_out(const char *path) {
+    int fd;
+
+    if ((fd = open(path, O_BINARY | O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+        fatal("%s: %s\n", path, strerror(errno));
+    outname = path;
+    return fd;
+}
+
+static void write_at(int out, const void *p, size_t n, off_t offset) {
+    if (lseek(out, offset, SEEK_SET) == -1 || write(out, p, n) != (ssize_t)n)
+        fatal("%s: write error\n", outname);
+}
+
+/* Copy the data of length bytes at src to dst, optionally into the CRC */
+static void copy_data(int in, off_t src, int out, off_t dst, uint64_t length,
+                      uint32_t *crc) {
+    ssize_t n;
+
+#ifdef __linux__
+    if (!crc) {
+        while (length > 0 &&
+               (n = copy_file_range(in, &src, out, &dst, length, 0)) > 0)
+            length -= n;
+    }
+#endif
+    if (lseek(in, src, SEEK_SET) == -1 || lseek(out, dst, SEEK_SET) == -1)
+        fatal("%s: %s\n", inname, strerror(errno));
+    while (length > 0) {
+        if ((n = read(in, buf, length < BUFSIZE ? length : BUFSIZE)) <= 0)
+            fatal("%s: %s\n", inname, n ? strerror(errno) : "unexpected end of file");
+        if (crc)
+            *crc = rkcrc32(*crc, buf, n);
+        if (write(out, buf, n) != n)
+            fatal("%s: write error\n", outname);
+        length -= n;
+    }
+}
+
+/*
+ * Copy length bytes at src to dst, leaving out the holes of the input.
+ * The output must not have data there already.
+ */
+static void copy_sparse(int in, off_t src, int out, off_t dst, uint64_t length) {
+    off_t pos = src, end = src + length, data, hole;
+
+    while (pos < end) {
+        data = pos;
+        hole = end;
+#ifdef SEEK_DATA
+        if ((data = lseek(in, pos, SEEK_DATA)) == -1) {
+            if (errno == ENXIO)
+                break;          /* a hole up to the end of the file */
+            data = pos;         /* no hole support */
+        } else if (data >= end) {
+            break;
+        } else if ((hole = lseek(in, data, SEEK_HOLE)) == -1 || hole > end)
+            hole = end;
+#endif
+        copy_data(in, data, out, dst + (data - src), hole - data, NULL);
+        pos = hole;
+    }
+}
+
+static void close_out(int out, uint64_t size) {
+    if (ftruncate(out, size) == -1 || close(out) == -1)
+        fatal("%s: %s\n", outname, strerror(errno));
+}
+
+/* pad size infile outfile: the input followed by a hole up to size blocks */
+static void pad(const char *blocks, const char *in_path, const char *out_path) {
+    struct stat st;
+    uint64_t size;
+    char *end;
+    int in, out;
+
+    size = strtoull(blocks, &end, 0) * 512;
+    if (*end || !*blocks)
+        fatal("%s: invalid size\n", blocks);
+
+    in  = open_in(in_path, &st);
+    out = open_out(out_path);
+    copy_sparse(in, 0, out, 0, st.st_size);
+    close_out(out, size > (uint64_t)st.st_size ? size : (uint64_t)st.st_size);
+    close(in);
+}
+
+/* misc action outfile: a 4MB misc partition with a bootloader message */
+static void misc(const char *action, const char *out_path) {
+    static const char *const actions[] = {
+        "wipe_all", "wipe_data", "wipe_cache", "wipe_userdata",
+        "wipe_swap", "wipe_udisk", "wipe_pagecache", "clear_account",
+        "update_image=", "recover_image=", NULL
+    };
+    const char *const *a;
+    int out;
+
+    if (strcmp(action, "nothing")) {
+        for (a = actions; *a; a++)
+            if ((*a)[strlen(*a) - 1] == '=' ? !strncmp(action, *a, strlen(*a))
+                                            : !strcmp(action, *a))
+                break;
+        if (!*a)
+            fatal("unknown action %s\n", action);
+    }
+
+    out = open_out(out_path);
+    if (strcmp(action, "nothing")) {
+        snprintf((char *)buf, BUFSIZE, "recovery\n--%s", action);
+        write_at(out, "boot-recovery", 13, 0x4000);
+        write_at(out, buf, strlen((char *)buf), 0x4040);
+    }
+    close_out(out, MISC_SIZE);
+}
+
+/* unsign infile outfile: strip the KRNL/PARM header and the CRC */
+static void unsign(const char *in_path, const char *out_path) {
+    struct stat st;
+    int in, out;
+
+    in = open_in(in_path, &st);
+    if (st.st_size < 12)
+        fatal("%s: too short\n", in_path);
+    out = open_out(out_path);
+    copy_sparse(in, 8, out, 0, st.st_size - 12);
+    close_out(out, st.st_size - 12);
+    close(in);
+}
+
+/* sign [-k|-p] infile outfile: add a KRNL/PARM header and the CRC */
+static void sign(const char *header, const char *in_path, const char *out_path) {
+    struct stat st;
+    uint32_t crc = 0;
+    uint8_t hdr[8];
+    off_t off = 0;
+    int in, out;
+
+    in  = open_in(in_path, &st);
+    out = open_out(out_path);
+    if (header) {
+        memcpy(hdr, header, 4);
+        PUT32LE(hdr+4, st.st_size);
+        write_at(out, hdr, 8, 0);
+        off = 8;
+    }
+    copy_data(in, 0, out, off, st.st_size, &crc);
+    PUT32LE(hdr, crc);
+    write_at(out, hdr, 4, off + st.st_size);
+    close_out(out, off + st.st_size + 4);
+    close(in);
+}
+
+int main(int argc, char *argv[]) {
+    const char *op = argc > 1 ? argv[1] : "";
+
+    argc -= 2;
+    argv += 2;
+
+    if (!strcmp(op, "pad") && argc == 3)
+        pad(argv[0], argv[1], argv[2]);
+    else if (!strcmp(op, "misc") && argc == 2)
+        misc(argv[0], argv[1]);
+    else if (!strcmp(op, "unsign") && argc == 2)
+        unsign(argv[0], argv[1]);
+    else if (!strcmp(op, "sign") && argc == 3 && !strcmp(argv[0], "-k"))
+        sign("KRNL", argv[1], argv[2]);
+    else if (!strcmp(op, "sign") && argc == 3 && !strcmp(argv[0], "-p"))
+        sign("PARM", argv[1], argv[2]);
+    else if (!strcmp(op, "sign") && argc == 2)
+        sign(NULL, argv[0], argv[1]);
+    else
+        fatal("rkimage v%d.%d\nusage: rkimage pad size infile outfile\n"
+              "       rkimage misc action outfile\n"
+              "       rkimage unsign infile outfile\n"
+              "       rkimage sign [-k|-p] infile outfile\n",
+              RKFLASHTOOL_VERSION_MAJOR, RKFLASHTOOL_VERSION_MINOR);
+
+    return 0;
+}
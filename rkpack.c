@@ -0,0 +1,485 @@
+/*-
+ * Copyright (c) 2013 Ivo van Poorten
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * rkpack builds an RKAF update.img from a package-file, the inverse of
+ * rkunpack: every line of the package-file is a name and a path relative
+ * to it, e.g.
+ *
+ *	parameter	parameter
+ *	bootloader	RK29xxLoader.bin
+ *	boot		Image/boot.img
+ *	backup		RESERVED
+ *	update-img	SELF
+ *
+ * RESERVED entries are left out, SELF stands for the image itself and
+ * the parameter entry is signed (PARM header and CRC) on the way.  With
+ * --boot the result is wrapped in an RKFW image with that loader.
+ *
+ * The layout is known from the file sizes, so the header is written
+ * first and then the entries are copied into place (copy_file_range on
+ * Linux), while another thread reads them once more from the page cache
+ * for the CRC at the end of the RKAF image (and the MD5 at the end of
+ * an RKFW image).  The padding between the entries is left as holes;
+ * its CRC is that of the crc before it, advanced over the zeroes.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE         /* copy_file_range */
+#endif
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "md5.h"
+#include "rkcrc.h"
+#include "rkflashtool.h"
+#include "version.h"
+
+#ifndef _WIN32
+#define O_BINARY 0
+#endif
+
+#define MAX_ENTRIES     16
+#define RKAF_HEADER     0x800       /* 0x8c + 16 entries, reserved */
+#define RKAF_ALIGN      0x800
+#define RKFW_HEADER     0x66
+#define BUFSIZE         0x100000
+
+static const char *const strings[2] = { "info", "fatal" };
+
+static void info_and_fatal(const int s, char *f, ...) {
+    va_list ap;
+    va_start(ap,f);
+    fprintf(stderr, "rkpack: %s: ", strings[s]);
+    vfprintf(stderr, f, ap);
+    va_end(ap);
+    if (s) exit(s);
+}
+
+#define info(...)   info_and_fatal(0, __VA_ARGS__)
+#define fatal(...)  info_and_fatal(1, __VA_ARGS__)
+
+struct entry {
+    char name[33];
+    char path[61];
+    char file[PATH_MAX];
+    uint64_t offset, size, padded;
+    uint8_t *data;              /* in memory (signed parameter) */
+    int self;
+};
+
+static struct entry entries[MAX_ENTRIES];
+static int nentries;
+
+static uint8_t header[RKAF_HEADER], rkfw[RKFW_HEADER];
+static uint64_t base, length;   /* of the RKAF image in the output */
+static struct entry boot;
+static int wrap, out;
+static const char *outname;
+
+/* Hashing thread */
+static uint32_t crc;
+static struct md5 md5;
+
+static void write_at(const void *p, uint64_t n, uint64_t offset) {
+    ssize_t nw;
+
+    if (lseek(out, offset, SEEK_SET) == -1)
+        fatal("%s: %s\n", outname, strerror(errno));
+    for (; n > 0; p = (const uint8_t *)p + nw, n -= nw)
+        if ((nw = write(out, p, n < BUFSIZE ? n : BUFSIZE)) <= 0)
+            fatal("%s: write error\n", outname);
+}
+
+static uint8_t *read_file(const char *path, uint64_t *size) {
+    struct stat st;
+    uint8_t *p;
+    int fd;
+
+    if ((fd = open(path, O_BINARY | O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+        fatal("%s: %s\n", path, strerror(errno));
+    if (!(p = malloc(st.st_size + 1)))
+        fatal("out of memory\n");
+    if (read(fd, p, st.st_size) != st.st_size)
+        fatal("%s: read error\n", path);
+    p[st.st_size] = '\0';
+    close(fd);
+    *size = st.st_size;
+    return p;
+}
+
+/* "KEY:value" line of the parameter file */
+static void parameter_value(const uint8_t *param, const char *key,
+                            char *value, size_t n) {
+    const char *p = strstr((const char *)param, key);
+    size_t len;
+
+    if (!p || (p != (const char *)param && p[-1] != '\n'))
+        return;
+    p += strlen(key);
+    len = strcspn(p, "\r\n");
+    snprintf(value, n, "%.*s", (int)len, p);
+}
+
+static void add_entry(const char *name, const char *path, const char *dir) {
+    struct entry *e;
+    struct stat st;
+    uint8_t *param;
+    uint64_t size;
+    char value[64];
+    unsigned int major = 0, minor = 0, patch = 0;
+
+    if (!strcmp(path, "RESERVED"))
+        return;
+    if (nentries == MAX_ENTRIES)
+        fatal("too many entries (at most %d)\n", MAX_ENTRIES);
+
+    e = &entries[nentries++];
+    if (strlen(name) >= sizeof(e->name) || strlen(path) >= sizeof(e->path))
+        fatal("%s %s: name or path too long\n", name, path);
+    snprintf(e->name, sizeof(e->name), "%.32s", name);
+    snprintf(e->path, sizeof(e->path), "%.60s", path);
+    if (snprintf(e->file, sizeof(e->file), "%s%s", path[0] == '/' ? "" : dir,
+                 path) >= (int)sizeof(e->file))
+        fatal("%s: path too long\n", path);
+
+    if (!strcmp(path, "SELF")) {
+        e->self = 1;
+        return;
+    }
+    if (strcmp(name, "parameter")) {
+        if (stat(e->file, &st) == -1)
+            fatal("%s: %s\n", e->file, strerror(errno));
+        e->size = st.st_size;
+        return;
+    }
+
+    /* the parameter file is stored signed */
+    param = read_file(e->file, &size);
+    if (!(e->data = malloc(size + 12)))
+        fatal("out of memory\n");
+    memcpy(e->data, "PARM", 4);
+    PUT32LE(e->data+4, size);
+    memcpy(e->data+8, param, size);
+    PUT32LE(e->data+8+size, rkcrc32(0, param, size));
+    e->size = size + 12;
+
+    /* which is also where the model and version of the image are */
+    value[0] = '\0';
+    parameter_value(param, "MACHINE_MODEL:", value, sizeof(value));
+    memcpy(header+0x08, value, strlen(value) < 0x22 ? strlen(value) : 0x22);
+    value[0] = '\0';
+    parameter_value(param, "MACHINE_ID:", value, sizeof(value));
+    memcpy(header+0x2a, value, strlen(value) < 0x1e ? strlen(value) : 0x1e);
+    value[0] = '\0';
+    parameter_value(param, "MANUFACTURER:", value, sizeof(value));
+    memcpy(header+0x48, value, strlen(value) < 0x38 ? strlen(value) : 0x38);
+    value[0] = '\0';
+    parameter_value(param, "FIRMWARE_VER:", value, sizeof(value));
+    if (sscanf(value, "%u.%u.%u", &major, &minor, &patch) >= 2)
+        PUT32LE(header+0x84, major << 24 | minor << 16 | patch);
+    free(param);
+}
+
+static void read_manifest(const char *path) {
+    char dir[PATH_MAX], line[PATH_MAX], name[64], file[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    FILE *fp;
+
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - path + 1) : 0, path);
+    if (!(fp = fopen(path, "r")))
+        fatal("%s: %s\n", path, strerror(errno));
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[strspn(line, " \t")] == '#')
+            continue;
+        if (sscanf(line, "%63s %4095s", name, file) == 2)
+            add_entry(name, file, dir);
+    }
+    fclose(fp);
+    if (!nentries)
+        fatal("%s: no entries\n", path);
+}
+
+/* Place the entries, fill in the header of the RKAF image */
+static void layout(void) {
+    struct entry *e;
+    uint8_t *p;
+    uint64_t pos = RKAF_HEADER;
+    int i;
+
+    for (i = 0, e = entries; i < nentries; i++, e++) {
+        if (e->self)
+            continue;
+        e->offset = pos;
+        e->padded = (e->size + RKAF_ALIGN - 1) & ~(uint64_t)(RKAF_ALIGN - 1);
+        pos += e->padded;
+    }
+    length = pos;
+    if (length + 4 > 0xffffffff)
+        fatal("image too large for RKAF (%llu bytes)\n", (unsigned long long)length + 4);
+
+    memcpy(header, "RKAF", 4);
+    PUT32LE(header+4, length);
+    PUT32LE(header+0x88, nentries);
+    for (i = 0, e = entries, p = header+0x8c; i < nentries; i++, e++, p += 0x70) {
+        if (e->self) {
+            e->size = e->padded = length + 4;
+            e->offset = 0;
+        }
+        memcpy(p, e->name, strlen(e->name));
+        memcpy(p+0x20, e->path, strlen(e->path));
+        PUT32LE(p+0x60, e->offset);
+        PUT32LE(p+0x68, e->padded);
+        PUT32LE(p+0x6c, e->size);
+    }
+}
+
+static void rkfw_header(unsigned int chip) {
+    time_t now = time(NULL);
+    struct tm *tm = localtime(&now);
+
+    memcpy(rkfw, "RKFW", 4);
+    rkfw[4] = RKFW_HEADER;
+    memcpy(rkfw+6, header+0x84, 4);             /* version */
+    rkfw[0x0e] = (tm->tm_year + 1900) & 0xff;
+    rkfw[0x0f] = (tm->tm_year + 1900) >> 8;
+    rkfw[0x10] = tm->tm_mon + 1;
+    rkfw[0x11] = tm->tm_mday;
+    rkfw[0x12] = tm->tm_hour;
+    rkfw[0x13] = tm->tm_min;
+    rkfw[0x14] = tm->tm_sec;
+    PUT32LE(rkfw+0x15, chip);
+    PUT32LE(rkfw+0x19, boot.offset);
+    PUT32LE(rkfw+0x1d, boot.size);
+    PUT32LE(rkfw+0x21, base);
+    PUT32LE(rkfw+0x25, length + 4);
+}
+
+/* Copy an entry into place */
+static void copy_entry(const struct entry *e, uint64_t offset) {
+    static uint8_t buf[BUFSIZE];
+    uint64_t left = e->size;
+    ssize_t n;
+    int in;
+
+    if (e->data) {
+        write_at(e->data, e->size, offset);
+        return;
+    }
+    if ((in = open(e->file, O_BINARY | O_RDONLY)) == -1)
+        fatal("%s: %s\n", e->file, strerror(errno));
+#ifdef __linux__
+    {
+        loff_t dst = offset;
+
+        while (left > 0 && (n = copy_file_range(in, NULL, out, &dst, left, 0)) > 0)
+            left -= n;
+    }
+#endif
+    if (lseek(out, offset + e->size - left, SEEK_SET) == -1)
+        fatal("%s: %s\n", outname, strerror(errno));
+    while (left > 0) {
+        if ((n = read(in, buf, left < BUFSIZE ? left : BUFSIZE)) <= 0)
+            fatal("%s: %s\n", e->file, n ? strerror(errno) : "file got shorter");
+        if (write(out, buf, n) != n)
+            fatal("%s: write error\n", outname);
+        left -= n;
+    }
+    close(in);
+}
+
+/*
+ * Hashing thread: the RKAF image goes into the CRC, with an RKFW image
+ * everything goes into the MD5.
+ */
+static void hash(const uint8_t *p, uint64_t n, int rkaf) {
+    if (rkaf)
+        crc = rkcrc32(crc, (uint8_t *)p, n);
+    if (wrap)
+        md5_update(&md5, p, n);
+}
+
+static void hash_zeroes(uint64_t n) {
+    static const uint8_t zero[RKAF_ALIGN];
+
+    crc = rkcrc32_combine(crc, 0, n);
+    for (; wrap && n > 0; n -= n < sizeof(zero) ? n : sizeof(zero))
+        md5_update(&md5, zero, n < sizeof(zero) ? n : sizeof(zero));
+}
+
+static void hash_entry(const struct entry *e, int rkaf) {
+    static uint8_t buf[BUFSIZE];
+    uint64_t left = e->size;
+    ssize_t n;
+    int in;
+
+    if (e->data) {
+        hash(e->data, e->size, rkaf);
+        return;
+    }
+    if ((in = open(e->file, O_BINARY | O_RDONLY)) == -1)
+        fatal("%s: %s\n", e->file, strerror(errno));
+    while (left > 0) {
+        if ((n = read(in, buf, left < BUFSIZE ? left : BUFSIZE)) <= 0)
+            fatal("%s: %s\n", e->file, n ? strerror(errno) : "file got shorter");
+        hash(buf, n, rkaf);
+        left -= n;
+    }
+    close(in);
+}
+
+static void *hash_thread(void *arg) {
+    uint64_t pos = RKAF_HEADER;
+    uint8_t tail[4];
+    int i;
+
+    (void)arg;
+    if (wrap) {
+        hash(rkfw, RKFW_HEADER, 0);
+        hash_entry(&boot, 0);
+    }
+    hash(header, RKAF_HEADER, 1);
+    for (i = 0; i < nentries; i++) {
+        if (entries[i].self)
+            continue;
+        hash_zeroes(entries[i].offset - pos);
+        hash_entry(&entries[i], 1);
+        pos = entries[i].offset + entries[i].size;
+    }
+    hash_zeroes(length - pos);
+    PUT32LE(tail, crc);
+    hash(tail, 4, 0);
+    return NULL;
+}
+
+static unsigned int chip_code(const char *name) {
+    static const struct { const char *name; unsigned int code; } chips[] = {
+        { "rk29xx", 0x50 }, { "rk30xx", 0x60 }, { "rk31xx", 0x70 },
+        { "rk32xx", 0x80 }, { "rk3368", 0x41 }, { NULL, 0 }
+    };
+    char *end;
+    int i;
+
+    for (i = 0; chips[i].name; i++)
+        if (!strcmp(name, chips[i].name))
+            return chips[i].code;
+    i = strtoul(name, &end, 0);
+    if (*end || !*name)
+        fatal("unknown chip %s\n", name);
+    return i;
+}
+
+int main(int argc, char *argv[]) {
+    const char *progname = argv[0], *chip = "rk30xx";
+    uint8_t digest[MD5_LENGTH], trailer[33];
+    pthread_t thread;
+    struct stat st;
+    int i;
+
+    for (argc--, argv++; argc > 2 && !strncmp(argv[0], "--", 2); argc -= 2, argv += 2) {
+        if (!strcmp(argv[0], "--boot"))
+            snprintf(boot.file, sizeof(boot.file), "%s", argv[1]);
+        else if (!strcmp(argv[0], "--chip"))
+            chip = argv[1];
+        else
+            break;
+    }
+
+    if (argc != 2)
+        fatal("rkpack v%d.%d\nusage: %s [--boot loader.bin [--chip rk30xx]] "
+              "package-file update.img\n",
+               RKFLASHTOOL_VERSION_MAJOR,
+               RKFLASHTOOL_VERSION_MINOR, progname);
+
+    read_manifest(argv[0]);
+    layout();
+
+    if ((wrap = boot.file[0] != '\0')) {
+        if ((i = open(boot.file, O_BINARY | O_RDONLY)) == -1 || fstat(i, &st) == -1)
+            fatal("%s: %s\n", boot.file, strerror(errno));
+        if (read(i, digest, 4) != 4 || memcmp(digest, "BOOT", 4))
+            fatal("%s: not a loader (no BOOT signature)\n", boot.file);
+        close(i);
+        boot.offset = RKFW_HEADER;
+        boot.size = st.st_size;
+        base = boot.offset + boot.size;
+        rkfw_header(chip_code(chip));
+        md5_init(&md5);
+    }
+
+    outname = argv[1];
+    if ((out = open(outname, O_BINARY | O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+        fatal("%s: %s\n", outname, strerror(errno));
+
+    for (i = 0; i < nentries; i++)
+        if (!entries[i].self)
+            info("%08llx-%08llx %-26s (size: %llu)\n",
+                 (unsigned long long)entries[i].offset,
+                 (unsigned long long)(entries[i].offset + entries[i].padded - 1),
+                 entries[i].path, (unsigned long long)entries[i].size);
+
+    if (pthread_create(&thread, NULL, hash_thread, NULL))
+        fatal("cannot create thread\n");
+
+    if (wrap) {
+        write_at(rkfw, RKFW_HEADER, 0);
+        copy_entry(&boot, boot.offset);
+    }
+    write_at(header, RKAF_HEADER, base);
+    for (i = 0; i < nentries; i++)
+        if (!entries[i].self)
+            copy_entry(&entries[i], base + entries[i].offset);
+
+    pthread_join(thread, NULL);
+
+    PUT32LE(trailer, crc);
+    write_at(trailer, 4, base + length);
+    info("checksum %08x\n", crc);
+    if (wrap) {
+        md5_final(&md5, digest);
+        for (i = 0; i < MD5_LENGTH; i++)
+            sprintf((char *)trailer + 2 * i, "%02x", digest[i]);
+        write_at(trailer, 32, base + length + 4);
+        info("md5 %s\n", trailer);
+    }
+
+    if (close(out) == -1)
+        fatal("%s: %s\n", outname, strerror(errno));
+
+    printf("packed\n");
+
+    return 0;
+}
@@ -24,6 +24,9 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE         /* copy_file_range */
+#endif
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -36,6 +39,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include "rkcrc.h"
+#include "rkflashtool.h"
 #include "version.h"
 
 #ifdef _WIN32       /* hack around non-posix behaviour */
@@ -48,10 +58,9 @@ HANDLE fm;
 #define O_BINARY 0
 #endif
 
-static uint8_t *buf;
-static off_t size;
-static unsigned int fsize, ioff, isize, noff;
-static int fd;
+static uint8_t *buf;            /* the mapped image, NULL when streaming */
+static uint64_t size;
+static int fd, listing;
 
 static const char *const strings[2] = { "info", "fatal" };
 
@@ -67,144 +76,616 @@ static void info_and_fatal(const int s, const char *f, ...) {
 #define info(...)   info_and_fatal(0, __VA_ARGS__)
 #define fatal(...)  info_and_fatal(1, __VA_ARGS__)
 
-#define GET32LE(x) ((x)[0] | (x)[1] << 8 | (x)[2] << 16 | (x)[3] << 24)
+/*
+ * The entries of the image: the files of the RKAF image, or BOOT and
+ * embedded-update.img of an RKFW image.  With --list or --extract the
+ * files of the embedded update.img are entries too (inner), so one can
+ * be pulled out of an RKFW image directly.  Offsets are 64-bit.
+ */
+struct entry {
+    char name[33];
+    char path[65];
+    uint64_t offset, length;
+    int inner, selected;
+    int out;                    /* streaming: output being written */
+};
+
+static struct entry *entries;
+static int nentries;
+static char **wanted;
+static int nwanted;
+
+static void make_dirs(const char *path) {
+    const char *sep = path;
+    char dir[PATH_MAX];
 
-static void write_file(const char *path, uint8_t *buffer, unsigned int length) {
-    int img;
-    if ((img = open(path, O_BINARY | O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
-               write(img, buffer, length) == -1 ||
-               close(img) == -1)
-        fatal("%s: %s\n", path, strerror(errno));
+    while ((sep = strchr(sep, '/')) != NULL) {
+        memcpy(dir, path, sep - path);
+        dir[sep - path] = '\0';
+        if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+            fatal("%s: %s\n", dir, strerror(errno));
+        sep++;
+    }
 }
 
-static void unpack_rkaf(void) {
-    uint8_t *p;
-    const char *name, *path, *sep;
-    char dir[PATH_MAX];
-    int count;
+/* --extract matches the name, the path or the file name of an entry */
+static int is_wanted(const struct entry *e) {
+    const char *base = strrchr(e->path, '/');
+    int i;
 
-    info("RKAF signature detected\n");
+    for (i = 0; i < nwanted; i++)
+        if (!strcmp(wanted[i], e->name) || !strcmp(wanted[i], e->path) ||
+            (base && !strcmp(wanted[i], base + 1))) {
+            wanted[i] = "";     /* found */
+            return 1;
+        }
+    return 0;
+}
 
-    fsize = GET32LE(buf+4) + 4;
-    if (fsize != (unsigned)size)
-        info("invalid file size (should be %u bytes)\n", fsize);
-    else
-        info("file size matches (%u bytes)\n", fsize);
+static void add_entry(const char *name, const char *path, uint64_t offset,
+                      uint64_t length, int inner) {
+    struct entry *e;
+
+    if (buf && offset + length > size)
+        fatal("%s: beyond the end of the image\n", path);
+    if (!(entries = realloc(entries, (nentries + 1) * sizeof(*entries))))
+        fatal("out of memory\n");
+    e = &entries[nentries++];
+    snprintf(e->name, sizeof(e->name), "%.32s", name);
+    snprintf(e->path, sizeof(e->path), "%.64s", path);
+    e->offset = offset;
+    e->length = length;
+    e->inner  = inner;
+    e->selected = nwanted ? is_wanted(e) : !inner && !listing;
+    e->out = -1;
+    if (listing)
+        printf("%-16s %-40s %12" PRIu64 "\n", e->name, e->path, e->length);
+}
 
-    info("manufacturer: %s\n", buf + 0x48);
-    info("model: %s\n", buf + 0x08);
+/* One writer per file: of the entries with the same path, the last wins */
+static void select_last(void) {
+    int i, j;
 
-    count = GET32LE(buf+0x88);
+    for (i = 0; i < nentries; i++)
+        for (j = i + 1; entries[i].selected && j < nentries; j++)
+            if (entries[j].selected && !strcmp(entries[i].path, entries[j].path))
+                entries[i].selected = 0;
+}
 
-    info("number of files: %d\n", count);
+/* Add the files in the file table of an RKAF image at base */
+static void add_rkaf_entries(const uint8_t *p, int count, uint64_t base, int inner) {
+    const char *name, *path;
+    uint32_t ioff, isize, fsize;
 
-    for (p = &buf[0x8c]; count > 0; p += 0x70, count--) {
+    for (; count > 0; p += 0x70, count--) {
         name = (const char *)p;
         path = (const char *)p + 0x20;
 
         ioff  = GET32LE(p+0x60);
-        noff  = GET32LE(p+0x64);
         isize = GET32LE(p+0x68);
         fsize = GET32LE(p+0x6c);
 
         if (memcmp(path, "SELF", 4) == 0) {
             info("skipping SELF entry\n");
         } else {
-            info("%08x-%08x %-26s (size: %d)\n", ioff, ioff + isize - 1, path, fsize);
+            info("%08" PRIx64 "-%08" PRIx64 " %-26s (size: %u)\n",
+                 base + ioff, base + ioff + isize - 1, path, fsize);
 
             // strip header and footer of parameter file
             if (memcmp(name, "parameter", 9) == 0) {
                 ioff += 8;
                 fsize -= 12;
             }
-
-            sep = path;
-            while ((sep = strchr(sep, '/')) != NULL) {
-                memcpy(dir, path, sep - path);
-                dir[sep - path] = '\0';
-                if (mkdir(dir, 0755) == -1 && errno != EEXIST)
-                    fatal("%s: %s\n", dir, strerror(errno));
-                sep++;
-            }
-
-            write_file(path, buf+ioff, fsize);
+            add_entry(name, path, base + ioff, fsize, inner);
         }
     }
 }
 
-static void unpack_rkfw(void) {
+static void rkaf_info(const uint8_t *p) {
+    info("manufacturer: %.56s\n", p + 0x48);
+    info("model: %.64s\n", p + 0x08);
+    info("number of files: %d\n", GET32LE(p+0x88));
+}
+
+static void rkfw_info(const uint8_t *p) {
     const char *chip = NULL;
 
     info("RKFW signature detected\n");
-    info("version: %d.%d.%d\n", buf[9], buf[8], (buf[7]<<8)+buf[6]);
+    info("version: %d.%d.%d\n", p[9], p[8], (p[7]<<8)+p[6]);
     info("date: %d-%02d-%02d %02d:%02d:%02d\n",
-            (buf[0x0f]<<8)+buf[0x0e], buf[0x10], buf[0x11],
-            buf[0x12], buf[0x13], buf[0x14]);
-    switch(buf[0x15]) {
+            (p[0x0f]<<8)+p[0x0e], p[0x10], p[0x11],
+            p[0x12], p[0x13], p[0x14]);
+    switch(p[0x15]) {
     case 0x50:  chip = "rk29xx"; break;
     case 0x60:  chip = "rk30xx"; break;
     case 0x70:  chip = "rk31xx"; break;
     case 0x80:  chip = "rk32xx"; break;
     case 0x41:  chip = "rk3368"; break;
-    default: info("You got a brand new chip (%#x), congratulations!!!\n", buf[0x15]);
+    default: info("You got a brand new chip (%#x), congratulations!!!\n", p[0x15]);
     }
     info("family: %s\n", chip ? chip : "unknown");
+}
 
-    ioff  = GET32LE(buf+0x19);
-    isize = GET32LE(buf+0x1d);
+/*
+ * Mapped images
+ *
+ * Files are extracted by a pool of threads, one file at a time each,
+ * while another thread checks the CRC at the end of the RKAF image.
+ * On Linux the data is copied by the kernel (copy_file_range, which can
+ * share extents on CoW filesystems, else sendfile), elsewhere it is
+ * written from the mapping.  Only the pages of the selected entries are
+ * touched, and the CRC is only checked when everything is extracted.
+ */
+#define MAX_THREADS 8
 
-    if (memcmp(buf+ioff, "BOOT", 4))
+static int next_job;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int copy_data(int img, off_t offset, uint64_t length) {
+    ssize_t n;
+
+#ifdef __linux__
+    while (length > 0 && (n = copy_file_range(fd, &offset, img, NULL, length, 0)) > 0)
+        length -= n;
+    while (length > 0 && (n = sendfile(img, fd, &offset, length)) > 0)
+        length -= n;
+#endif
+    while (length > 0) {
+        if ((n = write(img, buf + offset, length < 0x40000000 ? length : 0x40000000)) <= 0)
+            return -1;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static void write_file(const char *path, off_t offset, uint64_t length) {
+    int img;
+    if ((img = open(path, O_BINARY | O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+               copy_data(img, offset, length) == -1 ||
+               close(img) == -1)
+        fatal("%s: %s\n", path, strerror(errno));
+}
+
+static void *extract_thread(void *arg) {
+    int i;
+
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&job_lock);
+        while ((i = next_job++) < nentries && !entries[i].selected)
+            ;
+        pthread_mutex_unlock(&job_lock);
+        if (i >= nentries)
+            return NULL;
+        write_file(entries[i].path, entries[i].offset, entries[i].length);
+    }
+}
+
+static uint8_t *crc_data;
+static uint64_t crc_length;
+static uint32_t crc_result;
+
+static void *crc_thread(void *arg) {
+    (void)arg;
+    crc_result = rkcrc32(0, crc_data, crc_length);
+    return NULL;
+}
+
+static void run_jobs(void) {
+    pthread_t threads[MAX_THREADS], crc;
+    long n = 1;
+    int i, jobs = 0, checking = crc_length > 0 && !nwanted && !listing;
+
+    select_last();
+    for (i = 0; i < nentries; i++)
+        if (entries[i].selected) {
+            make_dirs(entries[i].path);
+            jobs++;
+        }
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (n > MAX_THREADS) n = MAX_THREADS;
+    if (n > jobs) n = jobs;
+
+    if (checking && pthread_create(&crc, NULL, crc_thread, NULL))
+        fatal("cannot create thread\n");
+    for (i = 0; i < n; i++)
+        if (pthread_create(&threads[i], NULL, extract_thread, NULL))
+            fatal("cannot create thread\n");
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+    if (checking) {
+        pthread_join(crc, NULL);
+        if (crc_result != (uint32_t)GET32LE(crc_data + crc_length))
+            fatal("bad checksum (%08x, should be %08x)\n",
+                  GET32LE(crc_data + crc_length), crc_result);
+        info("checksum matches (%08x)\n", crc_result);
+    }
+}
+
+static void unpack_rkaf(const uint8_t *p, uint64_t base, uint64_t length, int inner) {
+    uint32_t fsize;
+    int count;
+
+    info("RKAF signature detected\n");
+
+    /* the size field wraps for images of 4GB and more */
+    fsize = GET32LE(p+4) + 4;
+    if (fsize != (uint32_t)length)
+        info("invalid file size (should be %u bytes), not checking the checksum\n", fsize);
+    else {
+        info("file size matches (%" PRIu64 " bytes)\n", length);
+        crc_data   = (uint8_t *)p;
+        crc_length = length - 4;
+    }
+
+    rkaf_info(p);
+    count = GET32LE(p+0x88);
+    if (count < 0 || 0x8c + (uint64_t)count * 0x70 > length)
+        fatal("invalid number of files\n");
+    add_rkaf_entries(p + 0x8c, count, base, inner);
+}
+
+static void unpack_rkfw(void) {
+    uint64_t ioff, isize;
+
+    rkfw_info(buf);
+
+    ioff  = (uint32_t)GET32LE(buf+0x19);
+    isize = (uint32_t)GET32LE(buf+0x1d);
+
+    if (ioff + 4 > size || memcmp(buf+ioff, "BOOT", 4))
         fatal("cannot find BOOT signature\n");
 
-    info("%08x-%08x %-26s (size: %d)\n", ioff, ioff + isize -1, "BOOT", isize);
-    write_file("BOOT", buf+ioff, isize);
+    info("%08" PRIx64 "-%08" PRIx64 " %-26s (size: %" PRIu64 ")\n",
+         ioff, ioff + isize - 1, "BOOT", isize);
+    add_entry("BOOT", "BOOT", ioff, isize, 0);
 
-    ioff  = GET32LE(buf+0x21);
-    isize = GET32LE(buf+0x25);
+    ioff  = (uint32_t)GET32LE(buf+0x21);
+    isize = (uint32_t)GET32LE(buf+0x25);
 
-    if (memcmp(buf+ioff, "RKAF", 4))
+    if (ioff + 8 > size || memcmp(buf+ioff, "RKAF", 4))
         fatal("cannot find embedded RKAF update.img\n");
 
-    info("%08x-%08x %-26s (size: %d)\n", ioff, ioff + isize -1, "embedded-update.img", isize);
-    write_file("embedded-update.img", buf+ioff, isize);
+    /* an update.img of 4GB or more, up to the MD5 at the end */
+    if (ioff + isize + 32 < size && (uint32_t)(size - 32 - ioff) == isize)
+        isize = size - 32 - ioff;
+
+    info("%08" PRIx64 "-%08" PRIx64 " %-26s (size: %" PRIu64 ")\n",
+         ioff, ioff + isize - 1, "embedded-update.img", isize);
+    add_entry("embedded-update.img", "embedded-update.img", ioff, isize, 0);
+
+    /* the embedded update.img carries a checksum too */
+    if (nwanted || listing)
+        unpack_rkaf(buf + ioff, ioff, isize, 1);
+    else if ((uint32_t)GET32LE(buf+ioff+4) + 4 == (uint32_t)isize) {
+        crc_data   = buf + ioff;
+        crc_length = isize - 4;
+    }
+}
+
+/*
+ * Streaming
+ *
+ * An image on a pipe is read once, front to back, in chunks of at most
+ * STREAM_CHUNK bytes.  The chunks are cut at every start and end of an
+ * entry, so each chunk goes to all entries it belongs to as a whole.
+ * Headers are parsed when the stream gets to them: the file table of an
+ * RKAF image right at the start, that of an update.img embedded in an
+ * RKFW image at its offset.  Entries must be in file order.  The CRC of
+ * an RKAF image is computed on the way and checked at the end of the
+ * file, which makes images of 4GB and more work regardless of the
+ * wrapped size field.  The update.img in an RKFW image runs up to the
+ * 32-byte MD5 at the end of the file: when more than that follows where
+ * its wrapped size ends, it is 4GB longer.  With --extract, reading
+ * stops after the last selected entry.
+ */
+#define STREAM_CHUNK    0x100000
+#define RKFW_TRAILER    32          /* MD5 of the image, as hex */
+
+static uint8_t chunk[STREAM_CHUNK];
+static uint64_t pos;
+static uint32_t stream_crc;
+static uint8_t crc_tail[4];
+static int crc_tail_len, crc_stream;
+static uint64_t crc_start, crc_end = UINT64_MAX;   /* embedded update.img */
+static int embedded = -1;           /* its entry, in an RKFW image */
+static uint8_t ahead[RKFW_TRAILER + 1];
+static int nahead;                  /* bytes of ahead read, not yet used */
+
+/* Everything up to the last 4 bytes before crc_end goes into the CRC */
+static void stream_checksum(const uint8_t *p, uint64_t n) {
+    uint8_t tmp[8];
+    int k;
+
+    if (n >= 4) {
+        stream_crc = rkcrc32(stream_crc, crc_tail, crc_tail_len);
+        stream_crc = rkcrc32(stream_crc, (uint8_t *)p, n - 4);
+        memcpy(crc_tail, p + n - 4, 4);
+        crc_tail_len = 4;
+    } else {
+        memcpy(tmp, crc_tail, crc_tail_len);
+        memcpy(tmp + crc_tail_len, p, n);
+        k = crc_tail_len + n;
+        if (k > 4) {
+            stream_crc = rkcrc32(stream_crc, tmp, k - 4);
+            memcpy(crc_tail, tmp + k - 4, 4);
+            k = 4;
+        } else
+            memcpy(crc_tail, tmp, k);
+        crc_tail_len = k;
+    }
+}
+
+/* Read the next n bytes and pass them on, returns how many were read */
+static uint64_t stream_next(uint64_t n) {
+    struct entry *e;
+    uint64_t got = 0;
+    ssize_t r;
+    int i;
+
+    r = (uint64_t)nahead < n ? nahead : (int)n;
+    memcpy(chunk, ahead, r);
+    memmove(ahead, ahead + r, nahead - r);
+    nahead -= r;
+    got = r;
+    while (got < n && (r = read(fd, chunk + got, n - got)) > 0)
+        got += r;
+    if (got < n && r < 0)
+        fatal("read: %s\n", strerror(errno));
+
+    /* at the end of the embedded update.img, look for more than the MD5 */
+    if (embedded >= 0 && pos + got == crc_end) {
+        while (nahead < (int)sizeof(ahead) &&
+               (r = read(fd, ahead + nahead, sizeof(ahead) - nahead)) > 0)
+            nahead += r;
+        if (r < 0)
+            fatal("read: %s\n", strerror(errno));
+        if (nahead == sizeof(ahead)) {
+            crc_end += 1ULL << 32;
+            entries[embedded].length += 1ULL << 32;
+            info("embedded-update.img is %" PRIu64 " bytes or more\n",
+                 entries[embedded].length);
+        }
+    }
+
+    if (crc_stream && pos >= crc_start && pos < crc_end)
+        stream_checksum(chunk, got);
+
+    for (i = 0, e = entries; i < nentries; i++, e++) {
+        if (!e->selected || pos < e->offset || pos >= e->offset + e->length)
+            continue;
+        if (e->out == -1) {
+            make_dirs(e->path);
+            if ((e->out = open(e->path, O_BINARY | O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+                fatal("%s: %s\n", e->path, strerror(errno));
+        }
+        if (write(e->out, chunk, got) != (ssize_t)got)
+            fatal("%s: %s\n", e->path, strerror(errno));
+        if (pos + got == e->offset + e->length) {
+            if (close(e->out))
+                fatal("%s: %s\n", e->path, strerror(errno));
+            e->out = -2;        /* done */
+        }
+    }
+    pos += got;
+    return got;
+}
+
+/* How far the next chunk may go */
+static uint64_t stream_limit(uint64_t limit) {
+    struct entry *e;
+    int i;
+
+    if (limit - pos > STREAM_CHUNK)
+        limit = pos + STREAM_CHUNK;
+    for (i = 0, e = entries; i < nentries; i++, e++) {
+        if (!e->selected)
+            continue;
+        if (e->offset > pos && e->offset < limit)
+            limit = e->offset;
+        if (e->offset + e->length > pos && e->offset + e->length < limit)
+            limit = e->offset + e->length;
+    }
+    if (crc_start > pos && crc_start < limit)
+        limit = crc_start;
+    if (crc_end > pos && crc_end < limit)
+        limit = crc_end;
+    return limit;
+}
+
+/* Read up to offset, fail at the end of the file unless eof_ok */
+static void stream_skip(uint64_t offset, int eof_ok) {
+    while (pos < offset)
+        if (!stream_next(stream_limit(offset) - pos)) {
+            if (eof_ok)
+                return;
+            fatal("unexpected end of file at %" PRIu64 "\n", pos);
+        }
+}
 
+/* Read n header bytes at offset into p */
+static void stream_header(uint8_t *p, uint64_t offset, uint64_t n) {
+    uint64_t got;
+
+    stream_skip(offset, 0);
+    while (n > 0) {
+        if (!(got = stream_next(stream_limit(pos + n) - pos)))
+            fatal("unexpected end of file at %" PRIu64 "\n", pos);
+        memcpy(p, chunk, got);
+        p += got;
+        n -= got;
+    }
+}
+
+/*
+ * Read the file table of the RKAF image at base, the bytes of the
+ * header before pos have been read into hdr already
+ */
+static void stream_rkaf(uint8_t *hdr, uint64_t base, int inner) {
+    uint64_t have = pos > base ? pos - base : 0;
+    uint8_t *table;
+    int count;
+
+    stream_header(hdr + have, base + have, 0x8c - have);
+    if (memcmp(hdr, "RKAF", 4))
+        fatal("cannot find%s RKAF update.img\n", inner ? " embedded" : "");
+    info("RKAF signature detected\n");
+    rkaf_info(hdr);
+    count = GET32LE(hdr+0x88);
+    if (count < 0 || count > 0x10000)
+        fatal("invalid number of files\n");
+    if (!(table = malloc(count * 0x70 + 1)))
+        fatal("out of memory\n");
+    stream_header(table, base + 0x8c, count * 0x70);
+    add_rkaf_entries(table, count, base, inner);
+    free(table);
+}
+
+static void unpack_stream(void) {
+    uint8_t hdr[0x8c];
+    uint64_t ioff, isize, end = 0;
+    int i, rkfw;
+
+    stream_header(hdr, 0, 4);
+    if ((rkfw = !memcmp(hdr, "RKFW", 4))) {
+        stream_header(hdr + 4, 4, 0x29 - 4);
+        rkfw_info(hdr);
+
+        ioff  = (uint32_t)GET32LE(hdr+0x19);
+        isize = (uint32_t)GET32LE(hdr+0x1d);
+        info("%08" PRIx64 "-%08" PRIx64 " %-26s (size: %" PRIu64 ")\n",
+             ioff, ioff + isize - 1, "BOOT", isize);
+        add_entry("BOOT", "BOOT", ioff, isize, 0);
+
+        ioff  = (uint32_t)GET32LE(hdr+0x21);
+        isize = (uint32_t)GET32LE(hdr+0x25);
+        info("%08" PRIx64 "-%08" PRIx64 " %-26s (size: %" PRIu64 ")\n",
+             ioff, ioff + isize - 1, "embedded-update.img", isize);
+        add_entry("embedded-update.img", "embedded-update.img", ioff, isize, 0);
+        embedded = nentries - 1;
+
+        /* the checksum of the embedded update.img */
+        crc_stream = !nwanted && !listing;
+        crc_start  = ioff;
+        crc_end    = ioff + isize;
+        if (nwanted || listing)
+            stream_rkaf(hdr, ioff, 1);
+    } else if (!memcmp(hdr, "RKAF", 4)) {
+        crc_stream = !nwanted && !listing;
+        stream_crc = rkcrc32(0, hdr, 4);
+        stream_rkaf(hdr, 0, 0);
+    } else
+        fatal("invalid signature\n");
+    if (listing)
+        return;
+
+    select_last();
+    for (i = 0; i < nentries; i++) {
+        if (!entries[i].selected)
+            continue;
+        /* entries read along with the headers are written already */
+        if (entries[i].out == -1 && entries[i].length && entries[i].offset < pos)
+            fatal("%s: overlaps the file table, cannot stream\n", entries[i].path);
+        if (entries[i].offset + entries[i].length > end)
+            end = entries[i].offset + entries[i].length;
+        if (!entries[i].length) {
+            make_dirs(entries[i].path);
+            write_file(entries[i].path, 0, 0);
+        }
+    }
+    stream_skip(end, 0);
+    /* unless the embedded update.img turned out longer on the way */
+    if (embedded >= 0 && entries[embedded].selected)
+        while (pos < (end = entries[embedded].offset + entries[embedded].length))
+            stream_skip(end, 0);
+
+    if (crc_stream) {
+        /* the CRC is in the last 4 bytes (of the embedded update.img) */
+        do {
+            end = crc_end;
+            stream_skip(end, 1);
+        } while (crc_end != end);
+        if (crc_tail_len < 4)
+            fatal("unexpected end of file at %" PRIu64 "\n", pos);
+        if (stream_crc != (uint32_t)GET32LE(crc_tail))
+            fatal("bad checksum (%08x, should be %08x)\n",
+                  GET32LE(crc_tail), stream_crc);
+        info("checksum matches (%08x)\n", stream_crc);
+    }
 }
 
 int main(int argc, char *argv[]) {
+    struct stat st;
+    const char *progname = argv[0];
+    int i;
+
+    if (!(wanted = malloc(argc * sizeof(*wanted))))
+        fatal("out of memory\n");
+    for (argc--, argv++; argc > 1 && !strncmp(argv[0], "--", 2); argc--, argv++) {
+        if (!strcmp(argv[0], "--list"))
+            listing = 1;
+        else if (!strcmp(argv[0], "--extract") && argc > 2) {
+            wanted[nwanted++] = argv[1];
+            argc--, argv++;
+        } else
+            break;
+    }
 
-    if (argc != 2)
-        fatal("rkunpack v%d.%d\nusage: %s update.img\n",
+    if (argc != 1)
+        fatal("rkunpack v%d.%d\nusage: %s [--list] [--extract name]... update.img|-\n",
                RKFLASHTOOL_VERSION_MAJOR,
-               RKFLASHTOOL_VERSION_MINOR, argv[0]);
+               RKFLASHTOOL_VERSION_MINOR, progname);
+
+    if (!strcmp(argv[0], "-"))
+        fd = STDIN_FILENO;
+    else if ((fd = open(argv[0], O_BINARY | O_RDONLY)) == -1)
+        fatal("%s: %s\n", argv[0], strerror(errno));
 
-    if ((fd = open(argv[1], O_BINARY | O_RDONLY)) == -1)
-        fatal("%s: %s\n", argv[1], strerror(errno));
+    if (fstat(fd, &st) == -1)
+        fatal("%s: %s\n", argv[0], strerror(errno));
 
-    if ((size = lseek(fd, 0, SEEK_END)) == -1)
-        fatal("%s: %s\n", argv[1], strerror(errno));
+    if (!S_ISREG(st.st_mode)) {
+        unpack_stream();
+    } else {
+        size = st.st_size;
+        if (size < 0x8c)
+            fatal("%s: invalid signature\n", argv[0]);
 
 #ifdef _WIN32
-    fm  = CreateFileMapping((HANDLE)_get_osfhandle(fd), NULL, PAGE_READONLY, 0, 0, NULL);
-    buf = MapViewOfFile(fm, FILE_MAP_READ, 0, 0, 0);
-    if (!buf) fatal("%s: cannot create MapView of File\n", argv[1]);
+        fm  = CreateFileMapping((HANDLE)_get_osfhandle(fd), NULL, PAGE_READONLY, 0, 0, NULL);
+        buf = MapViewOfFile(fm, FILE_MAP_READ, 0, 0, 0);
+        if (!buf) fatal("%s: cannot create MapView of File\n", argv[0]);
 #else
-    if ((buf = mmap(NULL, size, PROT_READ, MAP_SHARED | MAP_FILE, fd, 0))
-                                                        == MAP_FAILED)
-        fatal("%s: %s\n", argv[1], strerror(errno));
+        if ((buf = mmap(NULL, size, PROT_READ, MAP_SHARED | MAP_FILE, fd, 0))
+                                                            == MAP_FAILED)
+            fatal("%s: %s\n", argv[0], strerror(errno));
 #endif
 
-         if (!memcmp(buf, "RKAF", 4)) unpack_rkaf();
-    else if (!memcmp(buf, "RKFW", 4)) unpack_rkfw();
-    else fatal("%s: invalid signature\n", argv[1]);
+             if (!memcmp(buf, "RKAF", 4)) unpack_rkaf(buf, 0, size, 0);
+        else if (!memcmp(buf, "RKFW", 4)) unpack_rkfw();
+        else fatal("%s: invalid signature\n", argv[0]);
 
-    printf("unpacked\n");
+        if (!listing)
+            run_jobs();
 
 #ifdef _WIN32
-    CloseHandle(fm);
-    UnmapViewOfFile(buf);
+        CloseHandle(fm);
+        UnmapViewOfFile(buf);
 #else
-    munmap(buf, size);
+        munmap(buf, size);
 #endif
+    }
+
+    for (i = 0; i < nwanted; i++)
+        if (*wanted[i])
+            fatal("%s: no such entry\n", wanted[i]);
+
+    if (!listing)
+        printf("unpacked\n");
 
     close(fd);
 
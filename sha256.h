@@ -0,0 +1,128 @@
+/*
+ * SHA-256 (FIPS 180-4), small and portable.
+ *
+ *	struct sha256 ctx;
+ *	uint8_t digest[SHA256_LENGTH];
+ *
+ *	sha256_init(&ctx);
+ *	sha256_update(&ctx, data, size);	(as often as needed)
+ *	sha256_final(&ctx, digest);
+ */
+
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define SHA256_LENGTH	32
+
+struct sha256 {
+	uint32_t state[8];
+	uint64_t size;		/* bytes hashed so far */
+	uint8_t block[64];
+};
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHA256_ROR(x, n)	((x) >> (n) | (x) << (32 - (n)))
+
+static inline void
+sha256_transform(struct sha256 *ctx, const uint8_t *p)
+{
+	uint32_t w[64], s[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++, p += 4)
+		w[i] = (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+		       (SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^ w[i - 15] >> 3) +
+		       (SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^ w[i - 2] >> 10);
+
+	memcpy(s, ctx->state, sizeof(s));
+	for (i = 0; i < 64; i++) {
+		t1 = s[7] + (SHA256_ROR(s[4], 6) ^ SHA256_ROR(s[4], 11) ^ SHA256_ROR(s[4], 25)) +
+		     ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+		t2 = (SHA256_ROR(s[0], 2) ^ SHA256_ROR(s[0], 13) ^ SHA256_ROR(s[0], 22)) +
+		     ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		memmove(s + 1, s, 7 * sizeof(uint32_t));
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+	for (i = 0; i < 8; i++)
+		ctx->state[i] += s[i];
+}
+
+static inline void
+sha256_init(struct sha256 *ctx)
+{
+	static const uint32_t h[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->state, h, sizeof(h));
+	ctx->size = 0;
+}
+
+static inline void
+sha256_update(struct sha256 *ctx, const uint8_t *data, uint64_t size)
+{
+	unsigned int used = ctx->size & 63, n;
+
+	ctx->size += size;
+	if (used) {
+		n = 64 - used < size ? 64 - used : size;
+		memcpy(ctx->block + used, data, n);
+		data += n;
+		size -= n;
+		if (used + n < 64)
+			return;
+		sha256_transform(ctx, ctx->block);
+	}
+	for (; size >= 64; data += 64, size -= 64)
+		sha256_transform(ctx, data);
+	memcpy(ctx->block, data, size);
+}
+
+static inline void
+sha256_final(struct sha256 *ctx, uint8_t *digest)
+{
+	unsigned int used = ctx->size & 63;
+	uint64_t bits = ctx->size << 3;
+	int i;
+
+	ctx->block[used++] = 0x80;
+	if (used > 56) {
+		memset(ctx->block + used, 0, 64 - used);
+		sha256_transform(ctx, ctx->block);
+		used = 0;
+	}
+	memset(ctx->block + used, 0, 56 - used);
+	for (i = 0; i < 8; i++)
+		ctx->block[56 + i] = bits >> (56 - 8 * i);
+	sha256_transform(ctx, ctx->block);
+
+	for (i = 0; i < 32; i++)
+		digest[i] = ctx->state[i / 4] >> (24 - 8 * (i % 4));
+}
+
+#endif /* !_SHA256_H_ */